@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "autoboot.h"
+#include "part.h"
+#include "utils.h"
+
+#define AUTOBOOT_CMDLINE_DELAY "kboot.autoboot"
+#define AUTOBOOT_PART          "bootloaders"
+#define AUTOBOOT_POWER_SUPPLY  "/sys/class/power_supply"
+
+/*
+ * Type specific attributes of the bootloaders partition:
+ * - bit 0: reboot to bootloader, cleared once seen
+ * - bits 1-4: autoboot delay in seconds, valid when bit 5 is set
+ */
+#define REBOOT_TO_BOOTLOADER BIT(0)
+#define AUTOBOOT_DELAY_SHIFT 1
+#define AUTOBOOT_DELAY_MASK  (0xf << AUTOBOOT_DELAY_SHIFT)
+#define AUTOBOOT_DELAY_SET   BIT(5)
+
+static bool check_reboot_bootloader_flag(uint64_t attr)
+{
+        int ret;
+
+        if (attr & REBOOT_TO_BOOTLOADER) {
+                attr &= ~REBOOT_TO_BOOTLOADER;
+                ret = part_write_attr(AUTOBOOT_PART, attr);
+                if (ret == -1)
+                        log("cannot write attributes to %s\n", AUTOBOOT_PART);
+                return true;
+        }
+
+        return false;
+}
+
+/* the command line overrides the per device delay stored in the GPT */
+static int autoboot_get_delay(uint64_t attr)
+{
+        char value[16];
+        int delay;
+
+        if (!cmdline_get(AUTOBOOT_CMDLINE_DELAY, value, sizeof(value))) {
+                delay = atoi(value);
+                return MIN(MAX(delay, 0), AUTOBOOT_MAX_DELAY);
+        }
+
+        if (attr & AUTOBOOT_DELAY_SET)
+                return (attr & AUTOBOOT_DELAY_MASK) >> AUTOBOOT_DELAY_SHIFT;
+
+        return AUTOBOOT_DEFAULT_DELAY;
+}
+
+static bool power_supply_is(const char *name, const char *property, const char *value)
+{
+        char path[512], buffer[128] = { '\0' };
+        ssize_t count;
+        int fd;
+
+        snprintf(path, sizeof(path), AUTOBOOT_POWER_SUPPLY "/%s/%s", name, property);
+
+        fd = open(path, O_RDONLY);
+        if (fd == -1)
+                return false;
+
+        count = read(fd, buffer, sizeof(buffer) - 1);
+        close(fd);
+        if (count <= 0)
+                return false;
+
+        return strstr(buffer, value) != NULL;
+}
+
+/*
+ * A USB host (not a wall charger) is connected: the device is on a bench or
+ * a flashing station, give fastboot a chance.
+ */
+static bool usb_host_present(void)
+{
+        struct dirent *entry;
+        bool present = false;
+        DIR *dir;
+
+        dir = opendir(AUTOBOOT_POWER_SUPPLY);
+        if (!dir)
+                return false;
+
+        while (!present && (entry = readdir(dir))) {
+                if (entry->d_name[0] == '.')
+                        continue;
+
+                if (!power_supply_is(entry->d_name, "online", "1"))
+                        continue;
+
+                /* standard or charging downstream port, both are hosts */
+                present = power_supply_is(entry->d_name, "usb_type", "[SDP]") ||
+                          power_supply_is(entry->d_name, "usb_type", "[CDP]");
+        }
+
+        closedir(dir);
+
+        return present;
+}
+
+static bool stdin_key_pressed(int timeout_ms)
+{
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        char c;
+
+        if (poll(&pfd, 1, timeout_ms) <= 0 || !(pfd.revents & POLLIN))
+                return false;
+
+        /* consume the key so it does not reach the console */
+        return read(STDIN_FILENO, &c, 1) == 1;
+}
+
+static bool prompt_stop_boot(int delay)
+{
+        for (int i = delay; i > 0; i--) {
+                log("Press any key to stop boot ... %i  \r", i);
+                fflush(stdout);
+
+                if (stdin_key_pressed(1000))
+                        return true;
+        }
+
+        return false;
+}
+
+static void set_terminal_single_char_read(void)
+{
+        struct termios local_term_attributes;
+
+        if (!isatty(STDIN_FILENO))
+                return;
+        if (tcgetattr(STDIN_FILENO, &local_term_attributes))
+                return;
+
+        local_term_attributes.c_lflag &= ~(ICANON | ECHO);
+        local_term_attributes.c_cc[VMIN] = 1;
+        local_term_attributes.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &local_term_attributes);
+}
+
+bool autoboot_stop(void)
+{
+        uint64_t attr = 0;
+        int delay;
+
+        if (part_read_attr(AUTOBOOT_PART, &attr) == -1)
+                log("cannot read attributes from %s\n", AUTOBOOT_PART);
+
+        if (check_reboot_bootloader_flag(attr)) {
+                log("reboot bootloader flag detected\n");
+                return true;
+        }
+
+        set_terminal_single_char_read();
+
+        delay = autoboot_get_delay(attr);
+        if (delay)
+                return prompt_stop_boot(delay);
+
+        /* no countdown: only a key already pressed or a USB host stop boot */
+        if (stdin_key_pressed(0))
+                return true;
+
+        if (usb_host_present()) {
+                log("USB host detected\n");
+                return true;
+        }
+
+        return false;
+}
+
+/* store the autoboot delay of this device, a negative delay restores the default */
+int autoboot_set_delay(int delay)
+{
+        uint64_t attr;
+
+        if (delay > AUTOBOOT_MAX_DELAY)
+                return -1;
+
+        if (part_read_attr(AUTOBOOT_PART, &attr) == -1)
+                return -1;
+
+        attr &= ~(AUTOBOOT_DELAY_MASK | AUTOBOOT_DELAY_SET);
+        if (delay >= 0)
+                attr |= AUTOBOOT_DELAY_SET | (delay << AUTOBOOT_DELAY_SHIFT);
+
+        return part_write_attr(AUTOBOOT_PART, attr);
+}
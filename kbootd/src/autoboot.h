@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#ifndef AUTOBOOT_H
+#define AUTOBOOT_H
+
+#include <stdbool.h>
+
+/* delay used when neither the GPT attribute nor the command line sets one */
+#define AUTOBOOT_DEFAULT_DELAY 5
+#define AUTOBOOT_MAX_DELAY     15
+
+bool autoboot_stop(void);
+int autoboot_set_delay(int delay);
+
+#endif
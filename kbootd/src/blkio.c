@@ -0,0 +1,634 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <errno.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "blkio.h"
+#include "kaio.h"
+#include "utils.h"
+
+/*
+ * Block device writer: payloads are split in BLKIO_SEGMENT_SIZE segments and
+ * up to BLKIO_QUEUE_DEPTH of them are kept in flight on an O_DIRECT fd,
+ * through io_uring or native AIO when io_uring is not available.
+ *
+ * Segments whose memory is not aligned for O_DIRECT are copied to a bounce
+ * buffer. Writes at an unaligned offset, and the unaligned tail of a write,
+ * go through a second, buffered fd.
+ *
+ * Writes are confined to a window of the device, usually a partition of the
+ * whole disk: both fds are shared and stay open after blkio_close.
+ *
+ * blkio_write may return before the data is written: buffers passed to it
+ * must stay untouched until blkio_flush returns.
+ *
+ * With BLKIO_DELTA, aligned segments are first read back and only the runs of
+ * BLKIO_DELTA_BLOCK blocks that differ are written.
+ */
+
+#define BLKIO_MIN_ALIGN   512
+#define BLKIO_DELTA_BLOCK 4096
+
+struct blkio_slot {
+        struct iovec iov;
+        uint64_t offset;
+        char *bounce;
+        struct iocb iocb;
+        bool busy;
+};
+
+struct blkio_uring {
+        int fd;
+        void *sq_ptr;
+        void *cq_ptr;
+        size_t sq_size;
+        size_t cq_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+        unsigned int *sq_tail;
+        unsigned int *sq_mask;
+        unsigned int *sq_array;
+        unsigned int *cq_head;
+        unsigned int *cq_tail;
+        unsigned int *cq_mask;
+        struct io_uring_cqe *cqes;
+};
+
+struct blkio;
+
+struct blkio_backend {
+        const char *name;
+        int (*setup)(struct blkio *bio);
+        int (*submit)(struct blkio *bio, struct blkio_slot *slot);
+        int (*reap)(struct blkio *bio);
+        void (*teardown)(struct blkio *bio);
+};
+
+struct blkio {
+        const char *name;
+        int fd;
+        int buffered_fd;
+        uint64_t base;
+        uint64_t size;
+        bool direct;
+        size_t align;
+        const struct blkio_backend *backend;
+        struct blkio_slot slots[BLKIO_QUEUE_DEPTH];
+        unsigned int inflight;
+        int error;
+        bool delta;
+        char *delta_buf;
+        uint64_t delta_total;
+        uint64_t delta_skipped;
+        struct blkio_uring uring;
+        aio_context_t aio_ctx;
+};
+
+static void blkio_complete(struct blkio *bio, struct blkio_slot *slot, long long res)
+{
+        if (res < 0) {
+                log("write %s at %llu failed: %s\n", bio->name,
+                    (unsigned long long)slot->offset, strerror(-res));
+                bio->error = -1;
+        } else if (res != slot->iov.iov_len) {
+                log("invalid write count: %lld != %zu\n", res, slot->iov.iov_len);
+                bio->error = -1;
+        }
+
+        slot->busy = false;
+        bio->inflight--;
+}
+
+/* io_uring backend, musl has no liburing: rings are mapped by hand */
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+        return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                          unsigned int flags)
+{
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_setup(struct blkio *bio)
+{
+        struct blkio_uring *ring = &bio->uring;
+        struct io_uring_params params = { 0 };
+
+        ring->fd = io_uring_setup(BLKIO_QUEUE_DEPTH, &params);
+        if (ring->fd == -1)
+                return -1;
+
+        ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->sq_size = MAX(ring->sq_size, ring->cq_size);
+                ring->cq_size = 0;
+        }
+
+        ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        if (ring->sq_ptr == MAP_FAILED)
+                goto err_close;
+
+        ring->cq_ptr = ring->sq_ptr;
+        if (ring->cq_size) {
+                ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, ring->fd,
+                                    IORING_OFF_CQ_RING);
+                if (ring->cq_ptr == MAP_FAILED)
+                        goto err_sq;
+        }
+
+        ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED)
+                goto err_cq;
+
+        ring->sq_tail = ring->sq_ptr + params.sq_off.tail;
+        ring->sq_mask = ring->sq_ptr + params.sq_off.ring_mask;
+        ring->sq_array = ring->sq_ptr + params.sq_off.array;
+        ring->cq_head = ring->cq_ptr + params.cq_off.head;
+        ring->cq_tail = ring->cq_ptr + params.cq_off.tail;
+        ring->cq_mask = ring->cq_ptr + params.cq_off.ring_mask;
+        ring->cqes = ring->cq_ptr + params.cq_off.cqes;
+
+        return 0;
+
+err_cq:
+        if (ring->cq_size)
+                munmap(ring->cq_ptr, ring->cq_size);
+err_sq:
+        munmap(ring->sq_ptr, ring->sq_size);
+err_close:
+        close(ring->fd);
+        return -1;
+}
+
+static int uring_submit(struct blkio *bio, struct blkio_slot *slot)
+{
+        struct blkio_uring *ring = &bio->uring;
+        struct io_uring_sqe *sqe;
+        unsigned int tail, index;
+
+        tail = *ring->sq_tail;
+        index = tail & *ring->sq_mask;
+
+        sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = bio->fd;
+        sqe->addr = (uintptr_t)&slot->iov;
+        sqe->len = 1;
+        sqe->off = slot->offset;
+        sqe->user_data = (uintptr_t)slot;
+
+        ring->sq_array[index] = index;
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        if (io_uring_enter(ring->fd, 1, 0, 0) != 1) {
+                log("io_uring_enter failed: %s\n", strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+static int uring_reap(struct blkio *bio)
+{
+        struct blkio_uring *ring = &bio->uring;
+        struct io_uring_cqe *cqe;
+        unsigned int head, count = 0;
+
+        while (!count) {
+                head = *ring->cq_head;
+
+                while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                        cqe = &ring->cqes[head & *ring->cq_mask];
+                        blkio_complete(bio, (struct blkio_slot *)(uintptr_t)cqe->user_data,
+                                       cqe->res);
+                        head++;
+                        count++;
+                }
+
+                __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+                if (!count && io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 &&
+                    errno != EINTR) {
+                        log("io_uring_enter failed: %s\n", strerror(errno));
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+static void uring_teardown(struct blkio *bio)
+{
+        struct blkio_uring *ring = &bio->uring;
+
+        munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_size)
+                munmap(ring->cq_ptr, ring->cq_size);
+        munmap(ring->sq_ptr, ring->sq_size);
+        close(ring->fd);
+}
+
+/* native AIO backend */
+
+static int aio_setup(struct blkio *bio)
+{
+        bio->aio_ctx = 0;
+
+        return io_setup(BLKIO_QUEUE_DEPTH, &bio->aio_ctx);
+}
+
+static int aio_submit(struct blkio *bio, struct blkio_slot *slot)
+{
+        struct iocb *iocb = &slot->iocb;
+
+        memset(iocb, 0, sizeof(struct iocb));
+        iocb->aio_fildes = bio->fd;
+        iocb->aio_lio_opcode = IOCB_CMD_PWRITE;
+        iocb->aio_buf = (uintptr_t)slot->iov.iov_base;
+        iocb->aio_nbytes = slot->iov.iov_len;
+        iocb->aio_offset = slot->offset;
+        iocb->aio_data = (uintptr_t)slot;
+
+        if (io_submit(bio->aio_ctx, 1, &iocb) != 1) {
+                log("io_submit failed: %s\n", strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+static int aio_reap(struct blkio *bio)
+{
+        struct io_event events[BLKIO_QUEUE_DEPTH];
+        int n;
+
+        do {
+                n = io_getevents(bio->aio_ctx, 1, BLKIO_QUEUE_DEPTH, events, NULL);
+        } while (n == -1 && errno == EINTR);
+
+        if (n == -1) {
+                log("io_getevents failed: %s\n", strerror(errno));
+                return -1;
+        }
+
+        for (int i = 0; i < n; i++)
+                blkio_complete(bio, (struct blkio_slot *)(uintptr_t)events[i].data,
+                               events[i].res);
+
+        return 0;
+}
+
+static void aio_teardown(struct blkio *bio)
+{
+        io_destroy(bio->aio_ctx);
+}
+
+/* synchronous backend, last resort */
+
+static int sync_setup(struct blkio *bio)
+{
+        return 0;
+}
+
+static int sync_submit(struct blkio *bio, struct blkio_slot *slot)
+{
+        ssize_t ret;
+
+        ret = pwrite(bio->fd, slot->iov.iov_base, slot->iov.iov_len, slot->offset);
+        blkio_complete(bio, slot, ret == -1 ? -errno : ret);
+
+        return 0;
+}
+
+static int sync_reap(struct blkio *bio)
+{
+        return 0;
+}
+
+static void sync_teardown(struct blkio *bio)
+{
+}
+
+static const struct blkio_backend blkio_backends[] = {
+        {
+                .name = "io_uring",
+                .setup = uring_setup,
+                .submit = uring_submit,
+                .reap = uring_reap,
+                .teardown = uring_teardown,
+        },
+        {
+                .name = "aio",
+                .setup = aio_setup,
+                .submit = aio_submit,
+                .reap = aio_reap,
+                .teardown = aio_teardown,
+        },
+        {
+                .name = "sync",
+                .setup = sync_setup,
+                .submit = sync_submit,
+                .reap = sync_reap,
+                .teardown = sync_teardown,
+        },
+};
+
+static struct blkio_slot *blkio_get_slot(struct blkio *bio)
+{
+        while (bio->inflight == BLKIO_QUEUE_DEPTH) {
+                if (bio->backend->reap(bio))
+                        return NULL;
+        }
+
+        for (int i = 0; i < BLKIO_QUEUE_DEPTH; i++) {
+                if (!bio->slots[i].busy)
+                        return &bio->slots[i];
+        }
+
+        return NULL;
+}
+
+static int blkio_submit(struct blkio *bio, uint64_t offset, char *data, size_t size)
+{
+        struct blkio_slot *slot;
+        size_t count;
+
+        while (size) {
+                count = MIN(size, BLKIO_SEGMENT_SIZE);
+
+                slot = blkio_get_slot(bio);
+                if (!slot)
+                        return -1;
+
+                slot->iov.iov_base = data;
+                slot->iov.iov_len = count;
+                slot->offset = offset;
+
+                if (bio->direct && ((uintptr_t)data % bio->align)) {
+                        if (!slot->bounce &&
+                            posix_memalign((void **)&slot->bounce, 4096, BLKIO_SEGMENT_SIZE)) {
+                                log("cannot allocate bounce buffer\n");
+                                return -1;
+                        }
+
+                        memcpy(slot->bounce, data, count);
+                        slot->iov.iov_base = slot->bounce;
+                }
+
+                slot->busy = true;
+                bio->inflight++;
+
+                if (bio->backend->submit(bio, slot)) {
+                        slot->busy = false;
+                        bio->inflight--;
+                        return -1;
+                }
+
+                offset += count;
+                data += count;
+                size -= count;
+        }
+
+        return 0;
+}
+
+static int blkio_queue_delta(struct blkio *bio, uint64_t offset, char *data,
+                             size_t size)
+{
+        size_t run, count, block;
+        ssize_t ret;
+
+        count = MIN(size, BLKIO_SEGMENT_SIZE);
+
+        ret = pread(bio->fd, bio->delta_buf, count, offset);
+        if (ret != count)
+                return blkio_submit(bio, offset, data, count);
+
+        bio->delta_total += count;
+
+        for (size_t pos = 0; pos < count; pos += run) {
+                block = MIN(count - pos, BLKIO_DELTA_BLOCK);
+
+                if (mem_equal(data + pos, bio->delta_buf + pos, block)) {
+                        bio->delta_skipped += block;
+                        run = block;
+                        continue;
+                }
+
+                /* coalesce the following differing blocks in one write */
+                run = block;
+                while (pos + run < count) {
+                        block = MIN(count - pos - run, BLKIO_DELTA_BLOCK);
+                        if (mem_equal(data + pos + run, bio->delta_buf + pos + run, block))
+                                break;
+                        run += block;
+                }
+
+                if (blkio_submit(bio, offset + pos, data + pos, run))
+                        return -1;
+        }
+
+        return 0;
+}
+
+static int blkio_queue(struct blkio *bio, uint64_t offset, char *data, size_t size)
+{
+        size_t count;
+
+        if (!bio->delta)
+                return blkio_submit(bio, offset, data, size);
+
+        while (size) {
+                count = MIN(size, BLKIO_SEGMENT_SIZE);
+
+                if (blkio_queue_delta(bio, offset, data, count))
+                        return -1;
+
+                offset += count;
+                data += count;
+                size -= count;
+        }
+
+        return 0;
+}
+
+int blkio_flush(struct blkio *bio)
+{
+        while (bio->inflight) {
+                if (bio->backend->reap(bio)) {
+                        bio->error = -1;
+                        break;
+                }
+        }
+
+        return bio->error;
+}
+
+static int blkio_write_buffered(struct blkio *bio, uint64_t offset, char *data,
+                                size_t size)
+{
+        ssize_t count_write;
+
+        /* the page cache must not race with direct writes of the same pages */
+        if (blkio_flush(bio))
+                return -1;
+
+        while (size) {
+                count_write = pwrite(bio->buffered_fd, data, size, offset);
+                if (count_write == -1) {
+                        log("write failed: %s\n", strerror(errno));
+                        return -1;
+                }
+
+                offset += count_write;
+                data += count_write;
+                size -= count_write;
+        }
+
+        return 0;
+}
+
+static int blkio_check(struct blkio *bio, uint64_t offset, uint64_t size)
+{
+        if (offset > bio->size || size > bio->size - offset) {
+                log("%s: access out of bounds at %llu (%llu bytes)\n", bio->name,
+                    (unsigned long long)offset, (unsigned long long)size);
+                return -1;
+        }
+
+        return 0;
+}
+
+int blkio_write(struct blkio *bio, uint64_t offset, void *data, size_t size)
+{
+        size_t aligned = size;
+
+        if (bio->error || blkio_check(bio, offset, size))
+                return -1;
+
+        offset += bio->base;
+
+        if (bio->direct) {
+                if (offset % bio->align)
+                        return blkio_write_buffered(bio, offset, data, size);
+
+                aligned -= size % bio->align;
+        }
+
+        if (blkio_queue(bio, offset, data, aligned))
+                return -1;
+
+        if (aligned != size)
+                return blkio_write_buffered(bio, offset + aligned, (char *)data + aligned,
+                                            size - aligned);
+
+        return 0;
+}
+
+int blkio_zeroout(struct blkio *bio, uint64_t offset, uint64_t size)
+{
+        uint64_t range[2] = { bio->base + offset, size };
+
+        if (blkio_check(bio, offset, size))
+                return -1;
+
+        /* the kernel picks write-zeroes, unmap or plain zero writes */
+        return ioctl(bio->fd, BLKZEROOUT, &range);
+}
+
+int blkio_discard(struct blkio *bio, uint64_t offset, uint64_t size)
+{
+        uint64_t range[2] = { bio->base + offset, size };
+
+        if (blkio_check(bio, offset, size))
+                return -1;
+
+        return ioctl(bio->fd, BLKDISCARD, &range);
+}
+
+struct blkio *blkio_open(const struct blkio_window *window, unsigned int flags)
+{
+        struct blkio *bio;
+        int lbs;
+
+        bio = calloc(1, sizeof(struct blkio));
+        if (!bio) {
+                log("malloc failed: %s\n", strerror(errno));
+                return NULL;
+        }
+
+        bio->name = window->name;
+        bio->base = window->base;
+        bio->size = window->size;
+        bio->buffered_fd = window->buffered_fd;
+
+        bio->direct = window->fd != -1;
+        bio->fd = bio->direct ? window->fd : window->buffered_fd;
+
+        if (ioctl(bio->fd, BLKSSZGET, &lbs) || lbs < BLKIO_MIN_ALIGN)
+                lbs = BLKIO_MIN_ALIGN;
+        bio->align = lbs;
+
+        if (flags & BLKIO_DELTA) {
+                bio->delta = !posix_memalign((void **)&bio->delta_buf, 4096,
+                                             BLKIO_SEGMENT_SIZE);
+                if (!bio->delta)
+                        log("cannot allocate delta buffer, writing everything\n");
+        }
+
+        for (int i = 0; i < ARRAY_SIZE(blkio_backends); i++) {
+                bio->backend = &blkio_backends[i];
+                if (!bio->backend->setup(bio))
+                        break;
+        }
+
+        return bio;
+}
+
+int blkio_close(struct blkio *bio)
+{
+        int ret;
+
+        ret = blkio_flush(bio);
+
+        /* O_DIRECT skips the page cache, not the device write cache */
+        if (fsync(bio->buffered_fd))
+                ret = -1;
+
+        bio->backend->teardown(bio);
+
+        for (int i = 0; i < BLKIO_QUEUE_DEPTH; i++)
+                free(bio->slots[i].bounce);
+
+        if (bio->delta && bio->delta_total)
+                log("delta: %llu/%llu KiB unchanged\n",
+                    (unsigned long long)(bio->delta_skipped / SZ_1K),
+                    (unsigned long long)(bio->delta_total / SZ_1K));
+        free(bio->delta_buf);
+
+        free(bio);
+
+        return ret;
+}
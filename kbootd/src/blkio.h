@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#ifndef BLKIO_H
+#define BLKIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/* compare with the device content, only write the blocks that differ */
+#define BLKIO_DELTA BIT(0)
+
+struct blkio;
+
+/*
+ * Region of an opened block device: offsets passed to blkio are relative to
+ * base and checked against size. The fds stay owned by the caller, fd is
+ * opened with O_DIRECT (or -1 to only use buffered_fd).
+ */
+struct blkio_window {
+        const char *name;
+        int fd;
+        int buffered_fd;
+        uint64_t base;
+        uint64_t size;
+};
+
+struct blkio *blkio_open(const struct blkio_window *window, unsigned int flags);
+int blkio_write(struct blkio *bio, uint64_t offset, void *data, size_t size);
+int blkio_zeroout(struct blkio *bio, uint64_t offset, uint64_t size);
+int blkio_discard(struct blkio *bio, uint64_t offset, uint64_t size);
+int blkio_flush(struct blkio *bio);
+int blkio_close(struct blkio *bio);
+
+#endif
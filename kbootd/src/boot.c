@@ -4,38 +4,358 @@
  * Author: Julien Masson <jmasson@baylibre.com>
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/kexec.h>
+#include <linux/reboot.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/reboot.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "android.h"
+#include "boot.h"
 #include "part.h"
+#include "progress.h"
 #include "utils.h"
 
-int boot_android(void)
-{
-        struct boot_img_hdr_v2 hdr;
-        char *path, *buffer;
-        char cmdline[BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE];
-        size_t cmdline_size = BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE;
+#define BOOT_SLICE_SIZE     (4 * SZ_1M)
+#define BOOT_CMDLINE_KEXEC  "kboot.kexec"
+#define BOOT_ENV_CMDLINE    "KBOOTD_CMDLINE"
+#define BOOT_CMDLINE_SIZE   (BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE + 1024)
+
+enum boot_section_id {
+        BOOT_KERNEL,
+        BOOT_RAMDISK,
+        BOOT_DTB,
+        BOOT_SECTIONS,
+};
+
+static const char *const boot_section_names[] = {
+        [BOOT_KERNEL] = "kernel",
+        [BOOT_RAMDISK] = "ramdisk",
+        [BOOT_DTB] = "dtb",
+};
+
+static const char *const boot_section_files[] = {
+        [BOOT_KERNEL] = "/boot/Image",
+        [BOOT_RAMDISK] = "/boot/ramdisk.img",
+        [BOOT_DTB] = "/boot/dtb.img",
+};
+
+/*
+ * A boot image section is read by its own thread in BOOT_SLICE_SIZE requests
+ * into data. When out is a file, each slice is written as soon as it is read
+ * so the writes overlap the reads of the other sections.
+ */
+struct boot_section {
+        struct boot_load *load;
+        enum boot_section_id id;
         size_t offset;
-        int fd, ret;
+        size_t size;
+        char *data;
+        int out;
+        int ret;
+        bool started;
+        pthread_t thread;
+};
 
-        path = part_get_path("boot_a");
-        if (!path) {
-                log("cannot find partition: %s\n", "boot_a");
+/*
+ * sections are read from fd at base, or copied from image when it was
+ * downloaded. size is the room for the boot image in either of them.
+ */
+struct boot_load {
+        int fd;
+        uint64_t base;
+        uint64_t size;
+        const char *image;
+        uint64_t done;
+        uint64_t total;
+        unsigned int running;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        struct boot_section sections[BOOT_SECTIONS];
+};
+
+/* the next kernel is loaded by kexec_file_load, boot_exec only has to jump */
+static bool boot_loaded;
+
+/* boot_android run in the background while the user can still stop boot */
+static pthread_t boot_prefetch_thread;
+static bool boot_prefetching;
+static int boot_prefetch_ret;
+static atomic_bool boot_cancel;
+
+static int boot_pread(int fd, char *data, size_t size, size_t offset)
+{
+        ssize_t count;
+
+        while (size) {
+                count = pread(fd, data, size, offset);
+                if (count == -1 && errno == EINTR)
+                        continue;
+
+                if (count <= 0)
+                        return -1;
+
+                data += count;
+                offset += count;
+                size -= count;
+        }
+
+        return 0;
+}
+
+static void *boot_section_thread(void *arg)
+{
+        struct boot_section *section = arg;
+        struct boot_load *load = section->load;
+        size_t done, count;
+
+        section->ret = 0;
+        for (done = 0; done < section->size; done += count) {
+                count = MIN(section->size - done, BOOT_SLICE_SIZE);
+
+                if (atomic_load(&boot_cancel)) {
+                        section->ret = -1;
+                        break;
+                }
+
+                if (load->image)
+                        memcpy(section->data + done, load->image + section->offset + done,
+                               count);
+                else
+                        section->ret = boot_pread(load->fd, section->data + done, count,
+                                                  load->base + section->offset + done);
+                if (section->ret) {
+                        log("read %s failed\n", boot_section_names[section->id]);
+                        break;
+                }
+
+                if (section->out != -1) {
+                        section->ret = kwrite_full(section->out, section->data + done,
+                                                   count, count);
+                        if (section->ret) {
+                                log("save %s failed\n", boot_section_names[section->id]);
+                                break;
+                        }
+                }
+
+                pthread_mutex_lock(&load->mutex);
+                load->done += count;
+                pthread_cond_signal(&load->cond);
+                pthread_mutex_unlock(&load->mutex);
+        }
+
+        pthread_mutex_lock(&load->mutex);
+        load->running--;
+        pthread_cond_signal(&load->cond);
+        pthread_mutex_unlock(&load->mutex);
+
+        return NULL;
+}
+
+/* section offsets, all entities are page_size aligned in the image */
+static void boot_layout(struct boot_load *load, struct boot_img_hdr_v2 *hdr)
+{
+        struct boot_section *sections = load->sections;
+        size_t page = hdr->page_size;
+
+        sections[BOOT_KERNEL].offset = page;
+        sections[BOOT_KERNEL].size = hdr->kernel_size;
+
+        sections[BOOT_RAMDISK].offset =
+                sections[BOOT_KERNEL].offset + DIV_ROUND_UP(hdr->kernel_size, page) * page;
+        sections[BOOT_RAMDISK].size = hdr->ramdisk_size;
+
+        sections[BOOT_DTB].offset = sections[BOOT_RAMDISK].offset +
+                                    DIV_ROUND_UP(hdr->ramdisk_size, page) * page +
+                                    DIV_ROUND_UP(hdr->second_size, page) * page +
+                                    DIV_ROUND_UP(hdr->recovery_dtbo_size, page) * page;
+        sections[BOOT_DTB].size = hdr->dtb_size;
+
+        for (int i = 0; i < BOOT_SECTIONS; i++) {
+                sections[i].load = load;
+                sections[i].id = i;
+                sections[i].data = NULL;
+                sections[i].out = -1;
+        }
+}
+
+/* read the sections with a data buffer in parallel, report progress meanwhile */
+static int boot_load_sections(struct boot_load *load, progress_cb progress, void *priv)
+{
+        struct boot_section *section;
+        struct timespec timeout;
+        uint64_t done, end = 0;
+        int ret = 0;
+
+        load->done = 0;
+        load->total = 0;
+        load->running = 0;
+
+        for (int i = 0; i < BOOT_SECTIONS; i++) {
+                section = &load->sections[i];
+                if (section->data) {
+                        load->total += section->size;
+                        end = MAX(end, section->offset + section->size);
+                }
+        }
+
+        /* one readahead over the whole image, the threads then hit the page cache */
+        if (!load->image) {
+                posix_fadvise(load->fd, load->base, end, POSIX_FADV_WILLNEED);
+                posix_fadvise(load->fd, load->base, end, POSIX_FADV_SEQUENTIAL);
+        }
+
+        for (int i = 0; i < BOOT_SECTIONS; i++) {
+                section = &load->sections[i];
+                section->started = false;
+                if (!section->data)
+                        continue;
+
+                pthread_mutex_lock(&load->mutex);
+                load->running++;
+                pthread_mutex_unlock(&load->mutex);
+
+                if (pthread_create(&section->thread, NULL, boot_section_thread, section)) {
+                        log("cannot create %s thread\n", boot_section_names[i]);
+                        pthread_mutex_lock(&load->mutex);
+                        load->running--;
+                        pthread_mutex_unlock(&load->mutex);
+                        ret = -1;
+                        continue;
+                }
+
+                section->started = true;
+        }
+
+        pthread_mutex_lock(&load->mutex);
+        while (1) {
+                if (progress) {
+                        done = load->done;
+                        pthread_mutex_unlock(&load->mutex);
+                        progress(priv, done, load->total);
+                        pthread_mutex_lock(&load->mutex);
+                }
+
+                if (!load->running)
+                        break;
+
+                clock_gettime(CLOCK_REALTIME, &timeout);
+                timeout.tv_sec += PROGRESS_PERIOD_MS / 1000;
+                pthread_cond_timedwait(&load->cond, &load->mutex, &timeout);
+        }
+        pthread_mutex_unlock(&load->mutex);
+
+        for (int i = 0; i < BOOT_SECTIONS; i++) {
+                section = &load->sections[i];
+                if (!section->started)
+                        continue;
+
+                pthread_join(section->thread, NULL);
+                if (section->ret)
+                        ret = -1;
+        }
+
+        return ret;
+}
+
+/* memfd of the size of a section, mapped for the section thread to read into */
+static int boot_memfd(struct boot_section *section)
+{
+        const char *name = boot_section_names[section->id];
+        int fd;
+
+        fd = memfd_create(name, MFD_CLOEXEC);
+        if (fd == -1) {
+                log("memfd %s failed: %s\n", name, strerror(errno));
                 return -1;
         }
 
-        ret = part_read(path, &hdr, 0, sizeof(struct boot_img_hdr_v2));
-        if (ret == -1) {
-                log("read boot image header failed\n");
+        if (ftruncate(fd, section->size)) {
+                log("memfd %s resize failed: %s\n", name, strerror(errno));
+                close(fd);
+                return -1;
+        }
+
+        section->data = mmap(NULL, section->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (section->data == MAP_FAILED) {
+                log("memfd %s map failed: %s\n", name, strerror(errno));
+                section->data = NULL;
+                close(fd);
+                return -1;
+        }
+
+        return fd;
+}
+
+/*
+ * Load kernel and ramdisk with kexec_file_load. The kernel keeps the device
+ * tree it was booted with and only updates its /chosen node, so this path is
+ * only taken for boot images without dtb.
+ */
+static int boot_kexec_file(struct boot_load *load, const char *cmdline,
+                           progress_cb progress, void *priv)
+{
+        struct boot_section *kernel = &load->sections[BOOT_KERNEL];
+        struct boot_section *ramdisk = &load->sections[BOOT_RAMDISK];
+        unsigned long flags = KEXEC_FILE_NO_INITRAMFS;
+        int kernel_fd, ramdisk_fd = -1;
+        long ret = -1;
+
+        kernel_fd = boot_memfd(kernel);
+        if (kernel_fd == -1)
                 return -1;
+
+        if (ramdisk->size) {
+                ramdisk_fd = boot_memfd(ramdisk);
+                if (ramdisk_fd == -1)
+                        goto exit;
+                flags = 0;
         }
 
+        if (boot_load_sections(load, progress, priv))
+                goto exit;
+
+        ret = syscall(SYS_kexec_file_load, kernel_fd, ramdisk_fd, strlen(cmdline) + 1,
+                      cmdline, flags);
+        if (ret)
+                log("kexec_file_load failed: %s\n", strerror(errno));
+
+exit:
+        if (ramdisk->data)
+                munmap(ramdisk->data, ramdisk->size);
+        if (ramdisk_fd != -1)
+                close(ramdisk_fd);
+
+        munmap(kernel->data, kernel->size);
+        close(kernel_fd);
+
+        kernel->data = NULL;
+        ramdisk->data = NULL;
+
+        return ret ? -1 : 0;
+}
+
+/* stage the sections in /boot for the kexec tool run by init */
+static int boot_stage(struct boot_load *load, struct boot_img_hdr_v2 *hdr,
+                      progress_cb progress, void *priv)
+{
+        char cmdline[BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE];
+        size_t cmdline_size = BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE;
+        struct boot_section *section;
+        int fd, ret = 0;
+
         /* cmdline */
         fd = open("/boot/cmdline", O_CREAT | O_WRONLY);
         if (fd == -1) {
@@ -43,7 +363,7 @@ int boot_android(void)
                 return -1;
         }
 
-        snprintf(cmdline, cmdline_size, "%s %s", hdr.cmdline, hdr.extra_cmdline);
+        snprintf(cmdline, cmdline_size, "%s %s", hdr->cmdline, hdr->extra_cmdline);
 
         ret = kwrite(fd, cmdline, cmdline_size);
         if (ret == -1)
@@ -51,82 +371,215 @@ int boot_android(void)
 
         close(fd);
 
-        /* Kernel */
-        fd = open("/boot/Image", O_CREAT | O_WRONLY);
-        if (fd == -1) {
-                log("open /boot/Image failed: %s\n", strerror(errno));
-                return -1;
+        /* kernel, ramdisk and dtb */
+        for (int i = 0; i < BOOT_SECTIONS; i++) {
+                section = &load->sections[i];
+
+                section->out = open(boot_section_files[i], O_CREAT | O_WRONLY);
+                if (section->out == -1) {
+                        log("open %s failed: %s\n", boot_section_files[i], strerror(errno));
+                        ret = -1;
+                        goto exit;
+                }
+
+                section->data = malloc(MAX(section->size, 1));
+                if (!section->data) {
+                        log("cannot allocate %s\n", boot_section_names[i]);
+                        ret = -1;
+                        goto exit;
+                }
         }
 
-        buffer = malloc(hdr.kernel_size);
-        offset = hdr.page_size;
+        ret = boot_load_sections(load, progress, priv);
 
-        ret = part_read(path, buffer, offset, hdr.kernel_size);
-        if (ret == -1) {
-                log("read kernel failed\n");
-                free(buffer);
-                close(fd);
-                return -1;
+exit:
+        for (int i = 0; i < BOOT_SECTIONS; i++) {
+                section = &load->sections[i];
+
+                free(section->data);
+                section->data = NULL;
+
+                if (section->out != -1)
+                        close(section->out);
+                section->out = -1;
         }
 
-        ret = kwrite_full(fd, buffer, hdr.kernel_size, 4096);
-        if (ret == -1)
-                log("save kernel failed\n");
+        return ret;
+}
 
-        free(buffer);
-        close(fd);
+/* boot image command line, followed by the one given by init */
+static void boot_cmdline(struct boot_img_hdr_v2 *hdr, char *cmdline, size_t size)
+{
+        const char *extra = getenv(BOOT_ENV_CMDLINE);
 
-        /* Ramdisk */
-        fd = open("/boot/ramdisk.img", O_CREAT | O_WRONLY);
-        if (fd == -1) {
-                log("open /boot/ramdisk.img failed: %s\n", strerror(errno));
+        snprintf(cmdline, size, "%.*s %.*s %s", BOOT_ARGS_SIZE, hdr->cmdline,
+                 BOOT_EXTRA_ARGS_SIZE, hdr->extra_cmdline, extra ? extra : "");
+}
+
+/*
+ * kexec_file_load cannot pass the boot image dtb: such images are staged for
+ * the kexec tool run by init, as with kboot.kexec=tool.
+ */
+static bool boot_kexec_file_enabled(struct boot_img_hdr_v2 *hdr)
+{
+        char value[16];
+
+        if (hdr->dtb_size)
+                return false;
+
+        if (cmdline_get(BOOT_CMDLINE_KEXEC, value, sizeof(value)))
+                return true;
+
+        return strcmp(value, "tool");
+}
+
+void boot_exec(void)
+{
+        if (!boot_loaded)
+                return;
+
+        log("kexec\n");
+        fflush(stdout);
+        reboot(LINUX_REBOOT_CMD_KEXEC);
+
+        log("kexec failed: %s\n", strerror(errno));
+}
+
+/* load the image with kexec_file_load, or stage it in /boot for init */
+static int boot_load_image(struct boot_load *load, struct boot_img_hdr_v2 *hdr,
+                           progress_cb progress, void *priv)
+{
+        char cmdline[BOOT_CMDLINE_SIZE];
+        int ret = -1;
+
+        boot_layout(load, hdr);
+
+        for (int i = 0; i < BOOT_SECTIONS; i++) {
+                if (load->sections[i].offset + load->sections[i].size > load->size) {
+                        log("boot image %s out of bounds\n", boot_section_names[i]);
+                        return -1;
+                }
+        }
+
+        pthread_mutex_init(&load->mutex, NULL);
+        pthread_cond_init(&load->cond, NULL);
+
+        if (boot_kexec_file_enabled(hdr)) {
+                boot_cmdline(hdr, cmdline, sizeof(cmdline));
+                ret = boot_kexec_file(load, cmdline, progress, priv);
+                if (!ret)
+                        boot_loaded = true;
+                else
+                        /* fall back to staging the images for the kexec tool */
+                        log("stage boot image in /boot\n");
+        }
+
+        if (ret && !atomic_load(&boot_cancel))
+                ret = boot_stage(load, hdr, progress, priv);
+
+        pthread_cond_destroy(&load->cond);
+        pthread_mutex_destroy(&load->mutex);
+
+        return ret;
+}
+
+int boot_android(progress_cb progress, void *priv)
+{
+        struct boot_load load = { 0 };
+        struct boot_img_hdr_v2 hdr;
+        struct part_info *info;
+        int ret;
+
+        info = part_get_by_name("boot_a");
+        if (!info) {
+                log("cannot find partition: %s\n", "boot_a");
                 return -1;
         }
 
-        buffer = malloc(hdr.ramdisk_size);
-        offset += DIV_ROUND_UP(hdr.kernel_size, hdr.page_size) * hdr.page_size;
+        /* boot_a is a window of the whole disk */
+        load.fd = info->fd;
+        load.base = info->offset;
+        load.size = info->size;
 
-        ret = part_read(path, buffer, offset, hdr.ramdisk_size);
+        ret = boot_pread(load.fd, (char *)&hdr, sizeof(struct boot_img_hdr_v2), load.base);
         if (ret == -1) {
-                log("read ramdisk failed\n");
-                free(buffer);
-                close(fd);
+                log("read boot image header failed\n");
                 return -1;
         }
 
-        ret = kwrite_full(fd, buffer, hdr.ramdisk_size, 4096);
-        if (ret == -1)
-                log("save ramdisk failed\n");
+        return boot_load_image(&load, &hdr, progress, priv);
+}
 
-        free(buffer);
-        close(fd);
+int boot_ram(const char *data, size_t size, progress_cb progress, void *priv)
+{
+        struct boot_load load = { .fd = -1, .size = size, .image = data };
+        struct boot_img_hdr_v2 hdr;
 
-        /* DTB */
-        fd = open("/boot/dtb.img", O_CREAT | O_WRONLY);
-        if (fd == -1) {
-                log("open /boot/dtb.img failed: %s\n", strerror(errno));
+        if (size < sizeof(struct boot_img_hdr_v2) ||
+            memcmp(data, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
+                log("invalid boot image\n");
                 return -1;
         }
 
-        buffer = malloc(hdr.dtb_size);
-        offset += DIV_ROUND_UP(hdr.ramdisk_size, hdr.page_size) * hdr.page_size;
-        offset += DIV_ROUND_UP(hdr.second_size, hdr.page_size) * hdr.page_size;
-        offset += DIV_ROUND_UP(hdr.recovery_dtbo_size, hdr.page_size) * hdr.page_size;
+        memcpy(&hdr, data, sizeof(struct boot_img_hdr_v2));
 
-        ret = part_read(path, buffer, offset, hdr.dtb_size);
-        if (ret == -1) {
-                log("read dtb failed\n");
-                free(buffer);
-                close(fd);
+        /* fields of the newer header versions are part of the kernel page */
+        if (hdr.header_version < 2)
+                hdr.dtb_size = 0;
+        if (hdr.header_version < 1)
+                hdr.recovery_dtbo_size = 0;
+
+        if (!hdr.page_size || !hdr.kernel_size) {
+                log("invalid boot image header\n");
                 return -1;
         }
 
-        ret = kwrite_full(fd, buffer, hdr.dtb_size, 4096);
-        if (ret == -1)
-                log("save dtb failed\n");
+        return boot_load_image(&load, &hdr, progress, priv);
+}
 
-        free(buffer);
-        close(fd);
+static void *boot_prefetch_run(void *arg)
+{
+        boot_prefetch_ret = boot_android(NULL, NULL);
 
-        return 0;
+        return NULL;
+}
+
+void boot_prefetch_start(void)
+{
+        atomic_store(&boot_cancel, false);
+
+        if (pthread_create(&boot_prefetch_thread, NULL, boot_prefetch_run, NULL)) {
+                log("cannot create boot prefetch thread\n");
+                return;
+        }
+
+        boot_prefetching = true;
+}
+
+int boot_prefetch_wait(void)
+{
+        if (!boot_prefetching)
+                return boot_android(NULL, NULL);
+
+        pthread_join(boot_prefetch_thread, NULL);
+        boot_prefetching = false;
+
+        return boot_prefetch_ret;
+}
+
+/* boot was stopped: drop what the prefetch loaded, fastboot continue reloads it */
+void boot_prefetch_cancel(void)
+{
+        if (!boot_prefetching)
+                return;
+
+        atomic_store(&boot_cancel, true);
+        pthread_join(boot_prefetch_thread, NULL);
+        boot_prefetching = false;
+        atomic_store(&boot_cancel, false);
+
+        if (boot_loaded) {
+                syscall(SYS_kexec_file_load, -1, -1, 0, NULL, KEXEC_FILE_UNLOAD);
+                boot_loaded = false;
+        }
 }
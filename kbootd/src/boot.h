@@ -7,6 +7,23 @@
 #ifndef BOOT_H
 #define BOOT_H
 
-int boot_android(void);
+#include <stddef.h>
+
+#include "progress.h"
+
+/* progress, when set, is called while the boot image is loaded */
+int boot_android(progress_cb progress, void *priv);
+/* same with a boot image held in memory (fastboot boot) */
+int boot_ram(const char *data, size_t size, progress_cb progress, void *priv);
+/* jump to the kernel loaded by boot_android, returns if it was left to init */
+void boot_exec(void);
+
+/*
+ * Run boot_android in the background (e.g. during the stop boot countdown),
+ * then either wait for its result or cancel it and drop what it loaded.
+ */
+void boot_prefetch_start(void);
+int boot_prefetch_wait(void);
+void boot_prefetch_cancel(void);
 
 #endif
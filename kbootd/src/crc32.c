@@ -0,0 +1,197 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+#include "crc32.h"
+
+#define CRC32_POLY 0xedb88320
+
+/* slicing-by-8 tables and x^(2^n) mod P, built once */
+static uint32_t crc32_table[8][256];
+static uint32_t crc32_x2n[32];
+#if defined(__aarch64__)
+static bool crc32_hw;
+#endif
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+/* a * b modulo the CRC polynomial, bit-reflected */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+        uint32_t m = 1U << 31;
+        uint32_t p = 0;
+
+        while (1) {
+                if (a & m) {
+                        p ^= b;
+                        if (!(a & (m - 1)))
+                                break;
+                }
+                m >>= 1;
+                b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+        }
+
+        return p;
+}
+
+/* x^(n * 2^k) modulo the CRC polynomial */
+static uint32_t crc32_x2nmodp(uint64_t n, unsigned int k)
+{
+        uint32_t p = 1U << 31;
+
+        while (n) {
+                if (n & 1)
+                        p = crc32_multmodp(crc32_x2n[k & 31], p);
+                n >>= 1;
+                k++;
+        }
+
+        return p;
+}
+
+static void crc32_init(void)
+{
+        uint32_t crc, p;
+
+        for (int i = 0; i < 256; i++) {
+                crc = i;
+                for (int j = 0; j < 8; j++)
+                        crc = crc & 1 ? (crc >> 1) ^ CRC32_POLY : crc >> 1;
+                crc32_table[0][i] = crc;
+        }
+
+        for (int i = 0; i < 256; i++) {
+                crc = crc32_table[0][i];
+                for (int j = 1; j < 8; j++) {
+                        crc = crc32_table[0][crc & 0xff] ^ (crc >> 8);
+                        crc32_table[j][i] = crc;
+                }
+        }
+
+        p = 1U << 30; /* x^1 */
+        crc32_x2n[0] = p;
+        for (int i = 1; i < 32; i++)
+                crc32_x2n[i] = p = crc32_multmodp(p, p);
+
+#if defined(__aarch64__) && defined(HWCAP_CRC32)
+        crc32_hw = getauxval(AT_HWCAP) & HWCAP_CRC32;
+#endif
+}
+
+static uint32_t crc32_sw(uint32_t crc, const uint8_t *p, size_t size)
+{
+        uint32_t lo, hi;
+
+        while (size && ((uintptr_t)p & 7)) {
+                crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+                size--;
+        }
+
+        /* little-endian only, like the rest of kbootd */
+        while (size >= 8) {
+                memcpy(&lo, p, 4);
+                memcpy(&hi, p + 4, 4);
+                lo ^= crc;
+
+                crc = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^
+                      crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+                      crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^
+                      crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+
+                p += 8;
+                size -= 8;
+        }
+
+        while (size--)
+                crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+        return crc;
+}
+
+#if defined(__aarch64__)
+__attribute__((target("+crc"))) static uint32_t crc32_arm(uint32_t crc, const uint8_t *p,
+                                                           size_t size)
+{
+        uint64_t v;
+
+        while (size && ((uintptr_t)p & 7)) {
+                crc = __crc32b(crc, *p++);
+                size--;
+        }
+
+        while (size >= 32) {
+                memcpy(&v, p, 8);
+                crc = __crc32d(crc, v);
+                memcpy(&v, p + 8, 8);
+                crc = __crc32d(crc, v);
+                memcpy(&v, p + 16, 8);
+                crc = __crc32d(crc, v);
+                memcpy(&v, p + 24, 8);
+                crc = __crc32d(crc, v);
+                p += 32;
+                size -= 32;
+        }
+
+        while (size >= 8) {
+                memcpy(&v, p, 8);
+                crc = __crc32d(crc, v);
+                p += 8;
+                size -= 8;
+        }
+
+        while (size--)
+                crc = __crc32b(crc, *p++);
+
+        return crc;
+}
+#endif
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size)
+{
+        pthread_once(&crc32_once, crc32_init);
+
+        crc = ~crc;
+
+#if defined(__aarch64__)
+        if (crc32_hw)
+                return ~crc32_arm(crc, data, size);
+#endif
+
+        return ~crc32_sw(crc, data, size);
+}
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t size2)
+{
+        pthread_once(&crc32_once, crc32_init);
+
+        return crc32_multmodp(crc32_x2nmodp(size2, 3), crc1) ^ crc2;
+}
+
+/* append size bytes of the repeated 32 bits value, in O(log(size)) */
+uint32_t crc32_fill(uint32_t crc, uint32_t value, uint64_t size)
+{
+        uint32_t block = crc32_update(0, &value, sizeof(value));
+        uint64_t block_size = sizeof(value);
+        uint64_t count = size / sizeof(value);
+
+        while (count) {
+                if (count & 1)
+                        crc = crc32_combine(crc, block, block_size);
+
+                block = crc32_combine(block, block, block_size);
+                block_size *= 2;
+                count >>= 1;
+        }
+
+        return crc;
+}
@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* IEEE 802.3 CRC32 (zlib, libsparse): crc32_update(0, data, size) for a new one */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size);
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t size2);
+uint32_t crc32_fill(uint32_t crc, uint32_t value, uint64_t size);
+
+#endif
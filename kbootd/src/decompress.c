@@ -0,0 +1,792 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decompress.h"
+#include "tpool.h"
+#include "utils.h"
+
+#define LZ4_MAGIC              0x184D2204
+#define LZ4_SKIPPABLE_MAGIC    0x184D2A50
+#define LZ4_SKIPPABLE_MASK     0xFFFFFFF0
+#define ZSTD_MAGIC             0xFD2FB528
+
+#define LZ4_FLG_VERSION_MASK   0xC0
+#define LZ4_FLG_VERSION        0x40
+#define LZ4_FLG_BLOCK_INDEP    BIT(5)
+#define LZ4_FLG_BLOCK_CHECKSUM BIT(4)
+#define LZ4_FLG_CONTENT_SIZE   BIT(3)
+#define LZ4_FLG_CONTENT_CSUM   BIT(2)
+#define LZ4_FLG_DICT_ID        BIT(0)
+#define LZ4_BLOCK_RAW          0x80000000U
+#define LZ4_HISTORY            (64 * SZ_1K)
+
+#define DECOMP_THREADS         4
+#define DECOMP_BATCH_SIZE      (16 * SZ_1M)
+#define DECOMP_ZSTD_OUT_SIZE   (8 * SZ_1M)
+
+/*
+ * LZ4 frames are parsed like sparse images, fed in fragments of any size.
+ * Compressed blocks are gathered in a batch of DECOMP_BATCH_SIZE output
+ * bytes; independent blocks of a batch are decompressed in parallel, linked
+ * blocks one after the other on top of the 64 KiB of history kept in front
+ * of the output buffer. zstd frames go through libzstd when available.
+ */
+enum lz4_state {
+        LZ4_STATE_MAGIC,
+        LZ4_STATE_SKIPPABLE,
+        LZ4_STATE_DESCRIPTOR,
+        LZ4_STATE_BLOCK_SIZE,
+        LZ4_STATE_BLOCK,
+        LZ4_STATE_BLOCK_CHECKSUM,
+        LZ4_STATE_CONTENT_CHECKSUM,
+};
+
+struct xxh32 {
+        uint32_t v[4];
+        uint32_t total;
+        uint8_t mem[16];
+        size_t mem_size;
+};
+
+struct lz4_block {
+        struct decomp *dec;
+        uint8_t *src;
+        size_t src_size;
+        bool raw;
+        bool has_checksum;
+        uint32_t checksum;
+        uint8_t *dst;
+        size_t dst_size;
+        int status;
+};
+
+struct decomp {
+        enum decomp_type type;
+        decomp_output output;
+        void *priv;
+
+        /* LZ4 frame parser */
+        enum lz4_state state;
+        uint8_t buf[16];
+        size_t buf_len;
+        size_t need;
+        size_t skip;
+        bool in_frame;
+        uint8_t flags;
+        size_t block_max;
+        struct xxh32 content;
+
+        /* LZ4 batch */
+        struct lz4_block *blocks;
+        unsigned int max_blocks;
+        unsigned int nblocks;
+        uint8_t *src;
+        uint8_t *out;
+        size_t history;
+        unsigned int pending;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+
+#ifdef HAVE_ZSTD
+        ZSTD_DCtx *zstd;
+        size_t zstd_left;
+#endif
+};
+
+static struct tpool *decomp_workers;
+static pthread_once_t decomp_once = PTHREAD_ONCE_INIT;
+
+static void decomp_init(void)
+{
+        decomp_workers = tpool_create(DECOMP_THREADS);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+        return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* xxHash32, used by LZ4 frames for their header, block and content checksums */
+
+#define XXH_P1 2654435761U
+#define XXH_P2 2246822519U
+#define XXH_P3 3266489917U
+#define XXH_P4 668265263U
+#define XXH_P5 374761393U
+
+static uint32_t xxh32_rotl(uint32_t x, int r)
+{
+        return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t xxh32_round(uint32_t acc, uint32_t input)
+{
+        return xxh32_rotl(acc + input * XXH_P2, 13) * XXH_P1;
+}
+
+static void xxh32_init(struct xxh32 *h)
+{
+        h->v[0] = XXH_P1 + XXH_P2;
+        h->v[1] = XXH_P2;
+        h->v[2] = 0;
+        h->v[3] = -XXH_P1;
+        h->total = 0;
+        h->mem_size = 0;
+}
+
+static void xxh32_update(struct xxh32 *h, const uint8_t *p, size_t size)
+{
+        size_t count;
+
+        h->total += size;
+
+        if (h->mem_size) {
+                count = MIN(size, 16 - h->mem_size);
+                memcpy(h->mem + h->mem_size, p, count);
+                h->mem_size += count;
+                p += count;
+                size -= count;
+
+                if (h->mem_size < 16)
+                        return;
+
+                for (int i = 0; i < 4; i++)
+                        h->v[i] = xxh32_round(h->v[i], get_le32(h->mem + i * 4));
+                h->mem_size = 0;
+        }
+
+        while (size >= 16) {
+                for (int i = 0; i < 4; i++)
+                        h->v[i] = xxh32_round(h->v[i], get_le32(p + i * 4));
+                p += 16;
+                size -= 16;
+        }
+
+        memcpy(h->mem, p, size);
+        h->mem_size = size;
+}
+
+static uint32_t xxh32_digest(struct xxh32 *h)
+{
+        const uint8_t *p = h->mem;
+        size_t size = h->mem_size;
+        uint32_t acc;
+
+        if (h->total >= 16)
+                acc = xxh32_rotl(h->v[0], 1) + xxh32_rotl(h->v[1], 7) +
+                      xxh32_rotl(h->v[2], 12) + xxh32_rotl(h->v[3], 18);
+        else
+                acc = h->v[2] + XXH_P5;
+
+        acc += h->total;
+
+        for (; size >= 4; p += 4, size -= 4)
+                acc = xxh32_rotl(acc + get_le32(p) * XXH_P3, 17) * XXH_P4;
+
+        for (; size; p++, size--)
+                acc = xxh32_rotl(acc + *p * XXH_P5, 11) * XXH_P1;
+
+        acc ^= acc >> 15;
+        acc *= XXH_P2;
+        acc ^= acc >> 13;
+        acc *= XXH_P3;
+        acc ^= acc >> 16;
+
+        return acc;
+}
+
+static uint32_t xxh32(const uint8_t *p, size_t size)
+{
+        struct xxh32 h;
+
+        xxh32_init(&h);
+        xxh32_update(&h, p, size);
+
+        return xxh32_digest(&h);
+}
+
+/* LZ4 block format, matches may reach back to base */
+static ssize_t lz4_decode_block(const uint8_t *src, size_t src_size, uint8_t *dst,
+                                size_t dst_size, const uint8_t *base)
+{
+        const uint8_t *ip = src, *iend = src + src_size;
+        uint8_t *op = dst, *oend = dst + dst_size;
+        const uint8_t *match;
+        size_t len, offset;
+        uint8_t token, b;
+
+        while (ip < iend) {
+                token = *ip++;
+
+                len = token >> 4;
+                if (len == 15) {
+                        do {
+                                if (ip == iend)
+                                        return -1;
+                                b = *ip++;
+                                len += b;
+                        } while (b == 255);
+                }
+
+                if (len > iend - ip || len > oend - op)
+                        return -1;
+
+                memcpy(op, ip, len);
+                ip += len;
+                op += len;
+
+                /* the last sequence only has literals */
+                if (ip == iend)
+                        break;
+
+                if (iend - ip < 2)
+                        return -1;
+
+                offset = ip[0] | ip[1] << 8;
+                ip += 2;
+
+                if (!offset || offset > op - base)
+                        return -1;
+
+                len = token & 15;
+                if (len == 15) {
+                        do {
+                                if (ip == iend)
+                                        return -1;
+                                b = *ip++;
+                                len += b;
+                        } while (b == 255);
+                }
+                len += 4;
+
+                if (len > oend - op)
+                        return -1;
+
+                match = op - offset;
+                if (offset >= len) {
+                        memcpy(op, match, len);
+                        op += len;
+                } else if (offset >= 8) {
+                        /* overlapping, but each 8 bytes copy is not */
+                        while (len >= 8) {
+                                memcpy(op, match, 8);
+                                op += 8;
+                                match += 8;
+                                len -= 8;
+                        }
+                        while (len--)
+                                *op++ = *match++;
+                } else {
+                        while (len--)
+                                *op++ = *match++;
+                }
+        }
+
+        return op - dst;
+}
+
+static int lz4_run_block(struct lz4_block *block, const uint8_t *base, size_t dst_size)
+{
+        ssize_t ret;
+
+        if (block->has_checksum && xxh32(block->src, block->src_size) != block->checksum) {
+                log("lz4 block checksum mismatch\n");
+                return -1;
+        }
+
+        if (block->raw) {
+                memcpy(block->dst, block->src, block->src_size);
+                block->dst_size = block->src_size;
+                return 0;
+        }
+
+        ret = lz4_decode_block(block->src, block->src_size, block->dst, dst_size, base);
+        if (ret == -1) {
+                log("corrupted lz4 block\n");
+                return -1;
+        }
+
+        block->dst_size = ret;
+
+        return 0;
+}
+
+static void lz4_block_task(void *arg, unsigned int worker)
+{
+        struct lz4_block *block = arg;
+        struct decomp *dec = block->dec;
+        int status;
+
+        status = lz4_run_block(block, block->dst, dec->block_max);
+
+        pthread_mutex_lock(&dec->mutex);
+        block->status = status;
+        dec->pending--;
+        pthread_cond_broadcast(&dec->cond);
+        pthread_mutex_unlock(&dec->mutex);
+}
+
+static int lz4_decode_batch(struct decomp *dec)
+{
+        uint8_t *out = dec->out + LZ4_HISTORY;
+        struct lz4_block *block;
+        size_t pos = 0, keep;
+        int ret = 0;
+
+        if (!dec->nblocks)
+                return 0;
+
+        if (dec->flags & LZ4_FLG_BLOCK_INDEP) {
+                for (unsigned int i = 0; i < dec->nblocks; i++) {
+                        block = &dec->blocks[i];
+                        block->dst = out + i * dec->block_max;
+
+                        if (decomp_workers) {
+                                pthread_mutex_lock(&dec->mutex);
+                                dec->pending++;
+                                pthread_mutex_unlock(&dec->mutex);
+
+                                if (!tpool_queue(decomp_workers, lz4_block_task, block))
+                                        continue;
+
+                                pthread_mutex_lock(&dec->mutex);
+                                dec->pending--;
+                                pthread_mutex_unlock(&dec->mutex);
+                        }
+
+                        block->status = lz4_run_block(block, block->dst, dec->block_max);
+                }
+
+                pthread_mutex_lock(&dec->mutex);
+                while (dec->pending)
+                        pthread_cond_wait(&dec->cond, &dec->mutex);
+                pthread_mutex_unlock(&dec->mutex);
+
+                /* only a last block can be short, close the gaps anyway */
+                for (unsigned int i = 0; i < dec->nblocks; i++) {
+                        block = &dec->blocks[i];
+                        if (block->status)
+                                ret = -1;
+                        else if (block->dst != out + pos)
+                                memmove(out + pos, block->dst, block->dst_size);
+                        pos += block->dst_size;
+                }
+        } else {
+                for (unsigned int i = 0; i < dec->nblocks && !ret; i++) {
+                        block = &dec->blocks[i];
+                        block->dst = out + pos;
+
+                        ret = lz4_run_block(block, out - dec->history, dec->block_max);
+                        pos += block->dst_size;
+                }
+        }
+
+        dec->nblocks = 0;
+
+        if (ret)
+                return -1;
+
+        if (dec->flags & LZ4_FLG_CONTENT_CSUM)
+                xxh32_update(&dec->content, out, pos);
+
+        if (dec->output(dec->priv, out, pos))
+                return -1;
+
+        /* linked blocks may reference the last 64 KiB of the previous batch */
+        keep = MIN(LZ4_HISTORY, dec->history + pos);
+        memmove(out - keep, out + pos - keep, keep);
+        dec->history = keep;
+
+        return 0;
+}
+
+static int lz4_alloc(struct decomp *dec, size_t block_max)
+{
+        if (dec->block_max == block_max)
+                return 0;
+
+        free(dec->blocks);
+        free(dec->src);
+        free(dec->out);
+
+        dec->block_max = block_max;
+        dec->max_blocks = MAX(DECOMP_BATCH_SIZE / block_max, 1);
+        dec->blocks = calloc(dec->max_blocks, sizeof(struct lz4_block));
+        dec->src = malloc(dec->max_blocks * block_max);
+        dec->out = malloc(LZ4_HISTORY + dec->max_blocks * block_max);
+
+        if (!dec->blocks || !dec->src || !dec->out) {
+                log("cannot allocate lz4 buffers\n");
+                dec->block_max = 0;
+                return -1;
+        }
+
+        for (unsigned int i = 0; i < dec->max_blocks; i++) {
+                dec->blocks[i].dec = dec;
+                dec->blocks[i].src = dec->src + i * block_max;
+        }
+
+        return 0;
+}
+
+static int lz4_parse_descriptor(struct decomp *dec)
+{
+        uint8_t flg = dec->buf[0];
+        uint8_t bd = dec->buf[1];
+        size_t len = 3;
+        int block_id;
+
+        if ((flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION) {
+                log("unsupported lz4 frame version\n");
+                return -1;
+        }
+
+        if (flg & LZ4_FLG_DICT_ID) {
+                log("lz4 dictionaries are not supported\n");
+                return -1;
+        }
+
+        if (flg & LZ4_FLG_CONTENT_SIZE)
+                len += 8;
+
+        /* FLG and BD come first, they tell the descriptor length */
+        if (dec->need < len) {
+                dec->need = len;
+                return 0;
+        }
+
+        if (((xxh32(dec->buf, len - 1) >> 8) & 0xff) != dec->buf[len - 1]) {
+                log("lz4 frame descriptor checksum mismatch\n");
+                return -1;
+        }
+
+        block_id = (bd >> 4) & 0x7;
+        if (block_id < 4) {
+                log("invalid lz4 block size\n");
+                return -1;
+        }
+
+        if (lz4_alloc(dec, 1 << (block_id * 2 + 8)))
+                return -1;
+
+        dec->flags = flg;
+        dec->history = 0;
+        xxh32_init(&dec->content);
+
+        dec->state = LZ4_STATE_BLOCK_SIZE;
+        dec->need = 4;
+        dec->buf_len = 0;
+
+        return 0;
+}
+
+static int lz4_parse_block_size(struct decomp *dec)
+{
+        uint32_t size = get_le32(dec->buf);
+        struct lz4_block *block;
+
+        dec->buf_len = 0;
+
+        /* EndMark */
+        if (!size) {
+                if (lz4_decode_batch(dec))
+                        return -1;
+
+                if (dec->flags & LZ4_FLG_CONTENT_CSUM) {
+                        dec->state = LZ4_STATE_CONTENT_CHECKSUM;
+                        dec->need = 4;
+                } else {
+                        dec->state = LZ4_STATE_MAGIC;
+                        dec->in_frame = false;
+                }
+
+                return 0;
+        }
+
+        block = &dec->blocks[dec->nblocks];
+        block->raw = size & LZ4_BLOCK_RAW;
+        block->src_size = size & ~LZ4_BLOCK_RAW;
+        block->has_checksum = dec->flags & LZ4_FLG_BLOCK_CHECKSUM;
+
+        if (block->src_size > dec->block_max) {
+                log("lz4 block too large: %zu\n", block->src_size);
+                return -1;
+        }
+
+        dec->state = LZ4_STATE_BLOCK;
+        dec->need = block->src_size;
+
+        return 0;
+}
+
+static int lz4_next_block(struct decomp *dec)
+{
+        dec->buf_len = 0;
+        dec->state = LZ4_STATE_BLOCK_SIZE;
+        dec->need = 4;
+
+        if (++dec->nblocks == dec->max_blocks)
+                return lz4_decode_batch(dec);
+
+        return 0;
+}
+
+/* Accumulate up to dec->need bytes in dec->buf, return true once complete */
+static bool lz4_gather(struct decomp *dec, uint8_t **data, size_t *size)
+{
+        size_t count = MIN(dec->need - dec->buf_len, *size);
+
+        memcpy(dec->buf + dec->buf_len, *data, count);
+        dec->buf_len += count;
+        *data += count;
+        *size -= count;
+
+        return dec->buf_len == dec->need;
+}
+
+static int lz4_feed(struct decomp *dec, uint8_t *ptr, size_t size)
+{
+        struct lz4_block *block;
+        uint32_t value;
+        size_t count;
+        int ret = 0;
+
+        while (size && !ret) {
+                if (dec->skip) {
+                        count = MIN(dec->skip, size);
+                        dec->skip -= count;
+                        ptr += count;
+                        size -= count;
+                        continue;
+                }
+
+                switch (dec->state) {
+                case LZ4_STATE_MAGIC:
+                        if (!lz4_gather(dec, &ptr, &size))
+                                break;
+
+                        value = get_le32(dec->buf);
+                        dec->buf_len = 0;
+
+                        if ((value & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+                                dec->state = LZ4_STATE_SKIPPABLE;
+                        } else if (value == LZ4_MAGIC) {
+                                dec->state = LZ4_STATE_DESCRIPTOR;
+                                dec->need = 2;
+                                dec->in_frame = true;
+                        } else {
+                                log("invalid lz4 frame magic: %08x\n", value);
+                                ret = -1;
+                        }
+                        break;
+
+                case LZ4_STATE_SKIPPABLE:
+                        if (!lz4_gather(dec, &ptr, &size))
+                                break;
+
+                        dec->skip = get_le32(dec->buf);
+                        dec->buf_len = 0;
+                        dec->state = LZ4_STATE_MAGIC;
+                        break;
+
+                case LZ4_STATE_DESCRIPTOR:
+                        if (lz4_gather(dec, &ptr, &size))
+                                ret = lz4_parse_descriptor(dec);
+                        break;
+
+                case LZ4_STATE_BLOCK_SIZE:
+                        if (lz4_gather(dec, &ptr, &size))
+                                ret = lz4_parse_block_size(dec);
+                        break;
+
+                case LZ4_STATE_BLOCK:
+                        /* blocks are copied, they may span several fragments */
+                        block = &dec->blocks[dec->nblocks];
+                        count = MIN(dec->need - dec->buf_len, size);
+                        memcpy(block->src + dec->buf_len, ptr, count);
+                        dec->buf_len += count;
+                        ptr += count;
+                        size -= count;
+
+                        if (dec->buf_len < dec->need)
+                                break;
+
+                        if (block->has_checksum) {
+                                dec->state = LZ4_STATE_BLOCK_CHECKSUM;
+                                dec->buf_len = 0;
+                                dec->need = 4;
+                                break;
+                        }
+
+                        ret = lz4_next_block(dec);
+                        break;
+
+                case LZ4_STATE_BLOCK_CHECKSUM:
+                        if (!lz4_gather(dec, &ptr, &size))
+                                break;
+
+                        dec->blocks[dec->nblocks].checksum = get_le32(dec->buf);
+                        ret = lz4_next_block(dec);
+                        break;
+
+                case LZ4_STATE_CONTENT_CHECKSUM:
+                        if (!lz4_gather(dec, &ptr, &size))
+                                break;
+
+                        if (get_le32(dec->buf) != xxh32_digest(&dec->content)) {
+                                log("lz4 content checksum mismatch\n");
+                                ret = -1;
+                                break;
+                        }
+
+                        dec->buf_len = 0;
+                        dec->need = 4;
+                        dec->state = LZ4_STATE_MAGIC;
+                        dec->in_frame = false;
+                        break;
+                }
+        }
+
+        return ret;
+}
+
+#ifdef HAVE_ZSTD
+static int zstd_feed(struct decomp *dec, uint8_t *data, size_t size)
+{
+        ZSTD_inBuffer in = { data, size, 0 };
+        ZSTD_outBuffer out;
+        size_t ret;
+
+        /* loop until the input is consumed and the output is not full */
+        do {
+                out = (ZSTD_outBuffer){ dec->out, DECOMP_ZSTD_OUT_SIZE, 0 };
+
+                ret = ZSTD_decompressStream(dec->zstd, &out, &in);
+                if (ZSTD_isError(ret)) {
+                        log("zstd: %s\n", ZSTD_getErrorName(ret));
+                        return -1;
+                }
+
+                dec->zstd_left = ret;
+
+                if (out.pos && dec->output(dec->priv, dec->out, out.pos))
+                        return -1;
+        } while (in.pos < in.size || out.pos == out.size);
+
+        return 0;
+}
+#endif
+
+enum decomp_type decomp_detect(void *data, size_t size)
+{
+        uint32_t magic;
+
+        if (size < sizeof(magic))
+                return DECOMP_NONE;
+
+        magic = get_le32(data);
+
+        if (magic == LZ4_MAGIC)
+                return DECOMP_LZ4;
+
+        if (magic == ZSTD_MAGIC)
+                return DECOMP_ZSTD;
+
+        return DECOMP_NONE;
+}
+
+struct decomp *decomp_open(enum decomp_type type, decomp_output output, void *priv)
+{
+        struct decomp *dec;
+
+#ifndef HAVE_ZSTD
+        if (type == DECOMP_ZSTD) {
+                log("zstd support not built in\n");
+                return NULL;
+        }
+#endif
+
+        pthread_once(&decomp_once, decomp_init);
+
+        dec = calloc(1, sizeof(struct decomp));
+        if (!dec) {
+                log("malloc failed: %s\n", strerror(errno));
+                return NULL;
+        }
+
+        dec->type = type;
+        dec->output = output;
+        dec->priv = priv;
+        dec->state = LZ4_STATE_MAGIC;
+        dec->need = 4;
+
+        pthread_mutex_init(&dec->mutex, NULL);
+        pthread_cond_init(&dec->cond, NULL);
+
+#ifdef HAVE_ZSTD
+        if (type == DECOMP_ZSTD) {
+                dec->zstd = ZSTD_createDCtx();
+                dec->out = malloc(DECOMP_ZSTD_OUT_SIZE);
+                if (!dec->zstd || !dec->out) {
+                        log("cannot allocate zstd context\n");
+                        decomp_close(dec);
+                        return NULL;
+                }
+        }
+#endif
+
+        return dec;
+}
+
+int decomp_feed(struct decomp *dec, void *data, size_t size)
+{
+#ifdef HAVE_ZSTD
+        if (dec->type == DECOMP_ZSTD)
+                return zstd_feed(dec, data, size);
+#endif
+
+        return lz4_feed(dec, data, size);
+}
+
+int decomp_close(struct decomp *dec)
+{
+        int ret = 0;
+
+        if (dec->in_frame || dec->skip || dec->buf_len) {
+                log("lz4 frame truncated\n");
+                ret = -1;
+        }
+
+#ifdef HAVE_ZSTD
+        if (dec->zstd_left) {
+                log("zstd frame truncated\n");
+                ret = -1;
+        }
+
+        ZSTD_freeDCtx(dec->zstd);
+#endif
+
+        pthread_cond_destroy(&dec->cond);
+        pthread_mutex_destroy(&dec->mutex);
+
+        free(dec->blocks);
+        free(dec->src);
+        free(dec->out);
+        free(dec);
+
+        return ret;
+}
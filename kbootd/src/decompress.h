@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum decomp_type {
+        DECOMP_NONE,
+        DECOMP_LZ4,
+        DECOMP_ZSTD,
+};
+
+/*
+ * Decompressed data is handed to output in order, the buffer is reused once
+ * output returns.
+ */
+typedef int (*decomp_output)(void *priv, void *data, size_t size);
+
+struct decomp;
+
+enum decomp_type decomp_detect(void *data, size_t size);
+
+struct decomp *decomp_open(enum decomp_type type, decomp_output output, void *priv);
+int decomp_feed(struct decomp *dec, void *data, size_t size);
+int decomp_close(struct decomp *dec);
+
+#endif
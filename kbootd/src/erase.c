@@ -0,0 +1,304 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "erase.h"
+#include "part.h"
+#include "tpool.h"
+#include "utils.h"
+
+#define ERASE_THREADS       4
+#define ERASE_CHUNK_SIZE    (64 * SZ_1M)
+#define ERASE_ZEROS_SIZE    SZ_1M
+#define ERASE_CACHE_LEN     8
+
+/*
+ * Erase methods, fastest first. The first one the device accepts is cached
+ * per disk, partitions of the same disk do not probe again.
+ */
+enum erase_method {
+        ERASE_DISCARD,
+        ERASE_SECDISCARD,
+        ERASE_ZEROOUT,
+        ERASE_WRITE,
+        ERASE_METHODS,
+};
+
+static const char *const erase_method_names[] = {
+        [ERASE_DISCARD] = "discard",
+        [ERASE_SECDISCARD] = "secure discard",
+        [ERASE_ZEROOUT] = "zeroout",
+        [ERASE_WRITE] = "zeros write",
+};
+
+struct erase_cache_entry {
+        char disk[32];
+        enum erase_method method;
+};
+
+static struct erase_cache_entry erase_cache[ERASE_CACHE_LEN];
+static unsigned int erase_cache_len;
+
+struct erase_chunk {
+        struct erase_ctx *ctx;
+        uint64_t offset;
+        uint64_t size;
+};
+
+struct erase_ctx {
+        int fd;
+        uint64_t base;
+        enum erase_method method;
+        uint64_t done;
+        unsigned int pending;
+        int error;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+};
+
+static struct tpool *erase_workers;
+static pthread_once_t erase_once = PTHREAD_ONCE_INIT;
+
+static void erase_init(void)
+{
+        erase_workers = tpool_create(ERASE_THREADS);
+}
+
+/* name of the disk holding the partition, from sysfs */
+static int erase_get_disk(int fd, char *disk, size_t disk_size)
+{
+        char path[PATH_MAX + 16], real[PATH_MAX];
+        struct stat st;
+
+        if (fstat(fd, &st) || !S_ISBLK(st.st_mode))
+                return -1;
+
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(st.st_rdev),
+                 minor(st.st_rdev));
+        if (!realpath(path, real))
+                return -1;
+
+        /* partitions are sysfs children of their disk */
+        snprintf(path, sizeof(path), "%s/partition", real);
+        if (file_exist(path))
+                dirname(real);
+
+        snprintf(disk, disk_size, "%s", basename(real));
+
+        return 0;
+}
+
+static struct erase_cache_entry *erase_cache_get(const char *disk)
+{
+        for (unsigned int i = 0; i < erase_cache_len; i++) {
+                if (!strcmp(erase_cache[i].disk, disk))
+                        return &erase_cache[i];
+        }
+
+        return NULL;
+}
+
+static void erase_cache_set(const char *disk, enum erase_method method)
+{
+        struct erase_cache_entry *entry;
+
+        if (!disk[0] || erase_cache_len == ERASE_CACHE_LEN)
+                return;
+
+        entry = &erase_cache[erase_cache_len++];
+        snprintf(entry->disk, sizeof(entry->disk), "%s", disk);
+        entry->method = method;
+}
+
+static int erase_zeros(int fd, uint64_t offset, uint64_t size)
+{
+        static char zeros[ERASE_ZEROS_SIZE];
+        ssize_t count;
+
+        while (size) {
+                count = pwrite(fd, zeros, MIN(size, ERASE_ZEROS_SIZE), offset);
+                if (count == -1 && errno == EINTR)
+                        continue;
+
+                if (count == -1)
+                        return -1;
+
+                offset += count;
+                size -= count;
+        }
+
+        return 0;
+}
+
+static int erase_range(int fd, enum erase_method method, uint64_t offset, uint64_t size)
+{
+        uint64_t range[2] = { offset, size };
+
+        switch (method) {
+        case ERASE_DISCARD:
+                return ioctl(fd, BLKDISCARD, &range);
+        case ERASE_SECDISCARD:
+                return ioctl(fd, BLKSECDISCARD, &range);
+        case ERASE_ZEROOUT:
+                return ioctl(fd, BLKZEROOUT, &range);
+        default:
+                return erase_zeros(fd, offset, size);
+        }
+}
+
+static void erase_chunk_task(void *arg, unsigned int worker)
+{
+        struct erase_chunk *chunk = arg;
+        struct erase_ctx *ctx = chunk->ctx;
+        int ret;
+
+        ret = erase_range(ctx->fd, ctx->method, ctx->base + chunk->offset, chunk->size);
+        if (ret)
+                log("erase at %llu failed: %s\n", (unsigned long long)chunk->offset,
+                    strerror(errno));
+
+        pthread_mutex_lock(&ctx->mutex);
+        if (ret)
+                ctx->error = -1;
+        ctx->done += chunk->size;
+        ctx->pending--;
+        pthread_cond_signal(&ctx->cond);
+        pthread_mutex_unlock(&ctx->mutex);
+
+        free(chunk);
+}
+
+static void erase_queue(struct erase_ctx *ctx, uint64_t offset, uint64_t size)
+{
+        struct erase_chunk *chunk;
+
+        chunk = malloc(sizeof(struct erase_chunk));
+        if (chunk) {
+                chunk->ctx = ctx;
+                chunk->offset = offset;
+                chunk->size = size;
+
+                pthread_mutex_lock(&ctx->mutex);
+                ctx->pending++;
+                pthread_mutex_unlock(&ctx->mutex);
+
+                if (erase_workers && !tpool_queue(erase_workers, erase_chunk_task, chunk))
+                        return;
+
+                pthread_mutex_lock(&ctx->mutex);
+                ctx->pending--;
+                pthread_mutex_unlock(&ctx->mutex);
+                free(chunk);
+        }
+
+        /* no worker: erase in the caller */
+        if (erase_range(ctx->fd, ctx->method, ctx->base + offset, size))
+                ctx->error = -1;
+        ctx->done += size;
+}
+
+/* erase the first chunk with the fastest method that works */
+static int erase_probe(struct erase_ctx *ctx, uint64_t size)
+{
+        for (int method = ERASE_DISCARD; method < ERASE_METHODS; method++) {
+                if (!erase_range(ctx->fd, method, ctx->base, size)) {
+                        ctx->method = method;
+                        return 0;
+                }
+        }
+
+        return -1;
+}
+
+int erase_part(struct part_info *info, progress_cb progress, void *priv)
+{
+        struct erase_cache_entry *cached = NULL;
+        struct erase_ctx ctx = { 0 };
+        uint64_t size, offset, count, done;
+        struct timespec timeout;
+        char disk[32] = "";
+
+        pthread_once(&erase_once, erase_init);
+
+        if (!info->size) {
+                log("cannot get size of %s\n", info->name);
+                return -1;
+        }
+
+        /* GPT partitions are a window of the whole disk */
+        ctx.fd = info->fd;
+        ctx.base = info->offset;
+        size = info->size;
+
+        pthread_mutex_init(&ctx.mutex, NULL);
+        pthread_cond_init(&ctx.cond, NULL);
+
+        if (!erase_get_disk(ctx.fd, disk, sizeof(disk)))
+                cached = erase_cache_get(disk);
+
+        count = MIN(size, ERASE_CHUNK_SIZE);
+        offset = 0;
+
+        if (cached) {
+                ctx.method = cached->method;
+        } else {
+                if (erase_probe(&ctx, count)) {
+                        log("cannot erase %s\n", info->name);
+                        ctx.error = -1;
+                        goto exit;
+                }
+
+                erase_cache_set(disk, ctx.method);
+                ctx.done = count;
+                offset = count;
+        }
+
+        log("erase %s: %s\n", info->name, erase_method_names[ctx.method]);
+
+        for (; offset < size; offset += count) {
+                count = MIN(size - offset, ERASE_CHUNK_SIZE);
+                erase_queue(&ctx, offset, count);
+        }
+
+        pthread_mutex_lock(&ctx.mutex);
+        while (1) {
+                if (progress) {
+                        done = ctx.done;
+                        pthread_mutex_unlock(&ctx.mutex);
+                        progress(priv, done, size);
+                        pthread_mutex_lock(&ctx.mutex);
+                }
+
+                if (!ctx.pending)
+                        break;
+
+                clock_gettime(CLOCK_REALTIME, &timeout);
+                timeout.tv_sec += PROGRESS_PERIOD_MS / 1000;
+                pthread_cond_timedwait(&ctx.cond, &ctx.mutex, &timeout);
+        }
+        pthread_mutex_unlock(&ctx.mutex);
+
+        if (ctx.method == ERASE_WRITE && fsync(ctx.fd))
+                ctx.error = -1;
+
+exit:
+        pthread_cond_destroy(&ctx.cond);
+        pthread_mutex_destroy(&ctx.mutex);
+
+        return ctx.error;
+}
@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#ifndef ERASE_H
+#define ERASE_H
+
+#include "progress.h"
+
+struct part_info;
+
+/* progress is called by the erasing thread at least every PROGRESS_PERIOD_MS */
+int erase_part(struct part_info *info, progress_cb progress, void *priv);
+
+#endif
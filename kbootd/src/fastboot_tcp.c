@@ -0,0 +1,328 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "transport.h"
+#include "utils.h"
+
+/*
+ * Fastboot TCP protocol (v1): after a 4 bytes "FBxx" handshake in both
+ * directions, every message is a packet made of a 8 bytes big-endian length
+ * followed by the payload. The host closes the connection after each
+ * fastboot invocation, the next one is accepted transparently.
+ */
+
+#define FASTBOOT_TCP_PORT      5554
+#define FASTBOOT_TCP_HANDSHAKE "FB01"
+#define FASTBOOT_TCP_HDR_LEN   8
+
+/* accept retry delays when out of resources, doubled up to the max */
+#define TCP_ACCEPT_DELAY_MS     10
+#define TCP_ACCEPT_MAX_DELAY_MS 1000
+
+static int tcp_server = -1;
+static int tcp_client = -1;
+
+/* payload bytes left in the packet currently being received */
+static uint64_t tcp_packet_left;
+
+static int tcp_recv(char *buffer, size_t buffer_count)
+{
+        ssize_t count_read;
+
+        while (buffer_count) {
+                count_read = recv(tcp_client, buffer, buffer_count, MSG_WAITALL);
+                if (count_read == -1 && errno == EINTR)
+                        continue;
+
+                if (count_read == -1) {
+                        log("tcp recv failed: %s\n", strerror(errno));
+                        return -1;
+                }
+
+                /* connection closed by the host */
+                if (count_read == 0)
+                        return -1;
+
+                buffer += count_read;
+                buffer_count -= count_read;
+        }
+
+        return 0;
+}
+
+static int tcp_send(struct iovec *iov, int iovcnt)
+{
+        struct msghdr msg = { 0 };
+        ssize_t count_write;
+
+        while (iovcnt) {
+                msg.msg_iov = iov;
+                msg.msg_iovlen = iovcnt;
+
+                /* no SIGPIPE if the host went away */
+                count_write = sendmsg(tcp_client, &msg, MSG_NOSIGNAL);
+                if (count_write == -1 && errno == EINTR)
+                        continue;
+
+                if (count_write == -1) {
+                        log("tcp send failed: %s\n", strerror(errno));
+                        return -1;
+                }
+
+                while (iovcnt && count_write >= iov->iov_len) {
+                        count_write -= iov->iov_len;
+                        iov++;
+                        iovcnt--;
+                }
+
+                if (iovcnt) {
+                        iov->iov_base = (char *)iov->iov_base + count_write;
+                        iov->iov_len -= count_write;
+                }
+        }
+
+        return 0;
+}
+
+static void tcp_disconnect(void)
+{
+        if (tcp_client != -1)
+                close(tcp_client);
+
+        tcp_client = -1;
+        tcp_packet_left = 0;
+}
+
+static int tcp_handshake(void)
+{
+        char handshake[4];
+        struct iovec iov = {
+                .iov_base = FASTBOOT_TCP_HANDSHAKE,
+                .iov_len = strlen(FASTBOOT_TCP_HANDSHAKE),
+        };
+
+        if (tcp_recv(handshake, sizeof(handshake)))
+                return -1;
+
+        if (handshake[0] != 'F' || handshake[1] != 'B') {
+                log("invalid tcp handshake\n");
+                return -1;
+        }
+
+        return tcp_send(&iov, 1);
+}
+
+/* accept errors only concerning the pending connection, see accept(2) */
+static bool tcp_accept_aborted(int err)
+{
+        switch (err) {
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+        case EPERM:
+        case ENETDOWN:
+        case ENETUNREACH:
+        case ENOPROTOOPT:
+        case EHOSTDOWN:
+        case EHOSTUNREACH:
+        case EOPNOTSUPP:
+        case ETIMEDOUT:
+                return true;
+        default:
+                return false;
+        }
+}
+
+/* accept errors going away once fds or memory are released */
+static bool tcp_accept_exhausted(int err)
+{
+        return err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM;
+}
+
+static void tcp_accept_wait(unsigned int delay_ms)
+{
+        struct timespec delay = {
+                .tv_sec = delay_ms / 1000,
+                .tv_nsec = (delay_ms % 1000) * 1000000L,
+        };
+
+        while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+                ;
+}
+
+static int tcp_connect(void)
+{
+        unsigned int delay_ms = TCP_ACCEPT_DELAY_MS;
+        int one = 1;
+        int err;
+
+        while (tcp_client == -1) {
+                tcp_client = accept(tcp_server, NULL, NULL);
+                if (tcp_client == -1) {
+                        err = errno;
+
+                        /* back off instead of spinning until resources are released */
+                        if (tcp_accept_exhausted(err)) {
+                                log("tcp accept failed: %s, retrying\n", strerror(err));
+                                tcp_accept_wait(delay_ms);
+                                delay_ms = MIN(delay_ms * 2, TCP_ACCEPT_MAX_DELAY_MS);
+                                continue;
+                        }
+
+                        if (tcp_accept_aborted(err))
+                                continue;
+
+                        log("tcp accept failed: %s\n", strerror(err));
+                        return -1;
+                }
+
+                delay_ms = TCP_ACCEPT_DELAY_MS;
+                setsockopt(tcp_client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                if (tcp_handshake())
+                        tcp_disconnect();
+        }
+
+        return 0;
+}
+
+static int tcp_packet_begin(void)
+{
+        uint64_t len;
+
+        if (tcp_recv((char *)&len, FASTBOOT_TCP_HDR_LEN))
+                return -1;
+
+        tcp_packet_left = be64toh(len);
+
+        return 0;
+}
+
+static int tcp_read(char *buffer, size_t buffer_count)
+{
+        size_t count;
+
+        /* wait for a host: a command is the first packet of each connection */
+        while (1) {
+                if (tcp_connect())
+                        return -1;
+
+                if (tcp_packet_left || !tcp_packet_begin())
+                        break;
+
+                tcp_disconnect();
+        }
+
+        count = MIN(tcp_packet_left, buffer_count);
+        if (tcp_recv(buffer, count)) {
+                tcp_disconnect();
+                return -1;
+        }
+
+        tcp_packet_left -= count;
+
+        return count;
+}
+
+static int tcp_read_full(char *buffer, size_t buffer_count)
+{
+        size_t count;
+
+        if (tcp_client == -1)
+                return -1;
+
+        /* download data may be split over several packets */
+        while (buffer_count) {
+                if (!tcp_packet_left && tcp_packet_begin())
+                        goto error;
+
+                count = MIN(tcp_packet_left, buffer_count);
+                if (tcp_recv(buffer, count))
+                        goto error;
+
+                tcp_packet_left -= count;
+                buffer += count;
+                buffer_count -= count;
+        }
+
+        return 0;
+
+error:
+        tcp_disconnect();
+        return -1;
+}
+
+static int tcp_write(char *buffer, size_t buffer_count)
+{
+        uint64_t len = htobe64(buffer_count);
+        struct iovec iov[2] = {
+                { .iov_base = &len,  .iov_len = FASTBOOT_TCP_HDR_LEN },
+                { .iov_base = buffer, .iov_len = buffer_count        },
+        };
+
+        if (tcp_client == -1)
+                return -1;
+
+        if (tcp_send(iov, ARRAY_SIZE(iov))) {
+                tcp_disconnect();
+                return -1;
+        }
+
+        return 0;
+}
+
+static int tcp_init(void)
+{
+        struct sockaddr_in addr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(FASTBOOT_TCP_PORT),
+                .sin_addr.s_addr = htonl(INADDR_ANY),
+        };
+        int one = 1;
+
+        tcp_server = socket(AF_INET, SOCK_STREAM, 0);
+        if (tcp_server == -1) {
+                log("socket failed: %s\n", strerror(errno));
+                return -1;
+        }
+
+        setsockopt(tcp_server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if (bind(tcp_server, (struct sockaddr *)&addr, sizeof(addr))) {
+                log("bind port %d failed: %s\n", FASTBOOT_TCP_PORT, strerror(errno));
+                close(tcp_server);
+                return -1;
+        }
+
+        if (listen(tcp_server, 1)) {
+                log("listen failed: %s\n", strerror(errno));
+                close(tcp_server);
+                return -1;
+        }
+
+        log("fastboot listening on tcp port %d\n", FASTBOOT_TCP_PORT);
+
+        return 0;
+}
+
+const struct fb_transport tcp_transport = {
+        .name = "tcp",
+        .init = tcp_init,
+        .read = tcp_read,
+        .write = tcp_write,
+        .read_full = tcp_read_full,
+};
@@ -0,0 +1,414 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/usb/functionfs.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "kaio.h"
+#include "transport.h"
+#include "utils.h"
+
+#define MTK_USB_DRIVER          "11201000.usb"
+
+#define FASTBOOT_INTERFACE_NAME "kbootd"
+
+#define USB_GADGET_UDC          "/config/usb_gadget/g1/UDC"
+
+#define USB_FASTBOOT_EP0        "/dev/usb-ffs/fastboot/ep0"
+#define USB_FASTBOOT_OUT        "/dev/usb-ffs/fastboot/ep1"
+#define USB_FASTBOOT_IN         "/dev/usb-ffs/fastboot/ep2"
+
+/* TODO: why this max value ? */
+#define FASTBOOT_READ_COUNT     (4096 * 15)
+
+#define MAX_PACKET_SIZE_FS      64
+#define MAX_PACKET_SIZE_HS      512
+#define MAX_PACKET_SIZE_SS      1024
+
+struct FuncDesc {
+        struct usb_interface_descriptor intf;
+        struct usb_endpoint_descriptor_no_audio source;
+        struct usb_endpoint_descriptor_no_audio sink;
+} __attribute__((packed));
+
+struct SsFuncDesc {
+        struct usb_interface_descriptor intf;
+        struct usb_endpoint_descriptor_no_audio source;
+        struct usb_ss_ep_comp_descriptor source_comp;
+        struct usb_endpoint_descriptor_no_audio sink;
+        struct usb_ss_ep_comp_descriptor sink_comp;
+} __attribute__((packed));
+
+struct DescV2 {
+        struct usb_functionfs_descs_head_v2 header;
+        /* The rest of the structure depends on the flags in the header. */
+        __le32 fs_count;
+        __le32 hs_count;
+        __le32 ss_count;
+        struct FuncDesc fs_descs, hs_descs;
+        struct SsFuncDesc ss_descs;
+} __attribute__((packed));
+
+const struct usb_interface_descriptor fastboot_interface = {
+        .bLength = USB_DT_INTERFACE_SIZE,
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = 0,
+        .bNumEndpoints = 2,
+        .bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+        .bInterfaceSubClass = 66,
+        .bInterfaceProtocol = 3,
+        .iInterface = 1, /* first string from the provided table */
+};
+
+static const struct FuncDesc fs_descriptors = {
+        .intf = fastboot_interface,
+        .source =
+	{
+		.bLength = sizeof(fs_descriptors.source),
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 1 | USB_DIR_OUT,
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,
+		.wMaxPacketSize = MAX_PACKET_SIZE_FS,
+	},
+        .sink =
+	{
+		.bLength = sizeof(fs_descriptors.sink),
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 1 | USB_DIR_IN,
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,
+		.wMaxPacketSize = MAX_PACKET_SIZE_FS,
+	},
+};
+
+static const struct FuncDesc hs_descriptors = {
+        .intf = fastboot_interface,
+        .source =
+	{
+		.bLength = sizeof(hs_descriptors.source),
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 1 | USB_DIR_OUT,
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,
+		.wMaxPacketSize = MAX_PACKET_SIZE_HS,
+	},
+        .sink =
+	{
+		.bLength = sizeof(hs_descriptors.sink),
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 1 | USB_DIR_IN,
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,
+		.wMaxPacketSize = MAX_PACKET_SIZE_HS,
+	},
+};
+
+static const struct SsFuncDesc ss_descriptors = {
+        .intf = fastboot_interface,
+        .source =
+	{
+		.bLength = sizeof(ss_descriptors.source),
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 1 | USB_DIR_OUT,
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,
+		.wMaxPacketSize = MAX_PACKET_SIZE_SS,
+	},
+        .source_comp =
+	{
+		.bLength = sizeof(ss_descriptors.source_comp),
+		.bDescriptorType = USB_DT_SS_ENDPOINT_COMP,
+		.bMaxBurst = 15,
+	},
+        .sink =
+	{
+		.bLength = sizeof(ss_descriptors.sink),
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 1 | USB_DIR_IN,
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,
+		.wMaxPacketSize = MAX_PACKET_SIZE_SS,
+	},
+        .sink_comp =
+	{
+		.bLength = sizeof(ss_descriptors.sink_comp),
+		.bDescriptorType = USB_DT_SS_ENDPOINT_COMP,
+		.bMaxBurst = 15,
+	},
+};
+
+static const struct {
+        struct usb_functionfs_strings_head header;
+        struct {
+                __le16 code;
+                const char str1[sizeof(FASTBOOT_INTERFACE_NAME)];
+        } __attribute__((packed)) lang0;
+} __attribute__((packed)) strings = {
+        .header =
+	{
+		.magic = htole32(FUNCTIONFS_STRINGS_MAGIC),
+		.length = htole32(sizeof(strings)),
+		.str_count = htole32(1),
+		.lang_count = htole32(1),
+	},
+        .lang0 =
+	{
+		htole16(0x0409), /* en-us */
+		FASTBOOT_INTERFACE_NAME,
+	},
+};
+
+static struct DescV2 v2_descriptor = {
+        .header =
+	{
+		.magic = htole32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+		.length = htole32(sizeof(v2_descriptor)),
+		.flags = FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC |
+		FUNCTIONFS_HAS_SS_DESC,
+	},
+        .fs_count = 3,
+        .hs_count = 3,
+        .ss_count = 5,
+        .fs_descs = fs_descriptors,
+        .hs_descs = hs_descriptors,
+        .ss_descs = ss_descriptors,
+};
+
+static int fb_ep0;
+static int fb_in;
+static int fb_out;
+
+/*
+ * Bulk OUT engine: keep USB_AIO_REQUESTS reads of USB_AIO_REQUEST_SIZE queued
+ * on the endpoint so the UDC never idles between two requests.
+ */
+struct usb_aio {
+        aio_context_t ctx;
+        int efd;
+        struct iocb iocbs[USB_AIO_REQUESTS];
+        struct iocb *free[USB_AIO_REQUESTS];
+        int n_free;
+        bool enabled;
+};
+
+static struct usb_aio usb_aio;
+
+static int usb_aio_init(void)
+{
+        if (!USB_AIO_REQUESTS)
+                return 0;
+
+        usb_aio.efd = eventfd(0, 0);
+        if (usb_aio.efd == -1) {
+                log("eventfd failed: %s\n", strerror(errno));
+                return -1;
+        }
+
+        if (io_setup(USB_AIO_REQUESTS, &usb_aio.ctx)) {
+                log("io_setup failed: %s\n", strerror(errno));
+                close(usb_aio.efd);
+                return -1;
+        }
+
+        for (int i = 0; i < USB_AIO_REQUESTS; i++)
+                usb_aio.free[i] = &usb_aio.iocbs[i];
+        usb_aio.n_free = USB_AIO_REQUESTS;
+        usb_aio.enabled = true;
+
+        return 0;
+}
+
+static int usb_aio_submit(char *buffer, size_t count)
+{
+        struct iocb *iocb = usb_aio.free[--usb_aio.n_free];
+
+        memset(iocb, 0, sizeof(struct iocb));
+        iocb->aio_fildes = fb_out;
+        iocb->aio_lio_opcode = IOCB_CMD_PREAD;
+        iocb->aio_buf = (uintptr_t)buffer;
+        iocb->aio_nbytes = count;
+        iocb->aio_flags = IOCB_FLAG_RESFD;
+        iocb->aio_resfd = usb_aio.efd;
+
+        if (io_submit(usb_aio.ctx, 1, &iocb) != 1) {
+                log("io_submit failed: %s\n", strerror(errno));
+                usb_aio.free[usb_aio.n_free++] = iocb;
+                return -1;
+        }
+
+        return 0;
+}
+
+/* Wait for at least one completion, return the number of bytes received */
+static ssize_t usb_aio_reap(void)
+{
+        struct io_event events[USB_AIO_REQUESTS];
+        struct iocb *iocb;
+        ssize_t total = 0;
+        uint64_t count;
+        int n;
+
+        if (read(usb_aio.efd, &count, sizeof(count)) != sizeof(count)) {
+                log("eventfd read failed: %s\n", strerror(errno));
+                return -1;
+        }
+
+        n = io_getevents(usb_aio.ctx, 1, USB_AIO_REQUESTS, events, NULL);
+        if (n < 0) {
+                log("io_getevents failed: %s\n", strerror(errno));
+                return -1;
+        }
+
+        for (int i = 0; i < n; i++) {
+                iocb = (struct iocb *)(uintptr_t)events[i].obj;
+                usb_aio.free[usb_aio.n_free++] = iocb;
+
+                if (events[i].res < 0) {
+                        log("usb read failed: %s\n", strerror(-events[i].res));
+                        total = -1;
+                } else if (events[i].res != iocb->aio_nbytes) {
+                        log("invalid read count: %lld != %llu\n", events[i].res,
+                            iocb->aio_nbytes);
+                        total = -1;
+                } else if (total != -1) {
+                        total += events[i].res;
+                }
+        }
+
+        return total;
+}
+
+/* Requests still queued after an error would eat the next command: drop them */
+static void usb_aio_cancel(void)
+{
+        struct io_event event;
+        uint64_t count;
+        int reaped = 0;
+        bool queued;
+
+        for (int i = 0; i < USB_AIO_REQUESTS; i++) {
+                queued = true;
+                for (int j = 0; j < usb_aio.n_free; j++) {
+                        if (usb_aio.free[j] == &usb_aio.iocbs[i])
+                                queued = false;
+                }
+
+                if (queued)
+                        io_cancel(usb_aio.ctx, &usb_aio.iocbs[i], &event);
+        }
+
+        while (usb_aio.n_free < USB_AIO_REQUESTS) {
+                if (io_getevents(usb_aio.ctx, 1, 1, &event, NULL) != 1)
+                        break;
+                usb_aio.free[usb_aio.n_free++] = (struct iocb *)(uintptr_t)event.obj;
+                reaped++;
+        }
+
+        /* completions of canceled requests are signaled too */
+        if (reaped && read(usb_aio.efd, &count, sizeof(count)) != sizeof(count))
+                log("eventfd read failed: %s\n", strerror(errno));
+}
+
+static int usb_aio_read_full(char *buffer, size_t buffer_count)
+{
+        size_t submitted = 0, received = 0, count;
+        ssize_t ret;
+
+        while (received < buffer_count) {
+                while (usb_aio.n_free && submitted < buffer_count) {
+                        count = MIN(buffer_count - submitted, USB_AIO_REQUEST_SIZE);
+                        if (usb_aio_submit(buffer + submitted, count))
+                                goto error;
+                        submitted += count;
+                }
+
+                ret = usb_aio_reap();
+                if (ret == -1)
+                        goto error;
+                received += ret;
+        }
+
+        return 0;
+
+error:
+        usb_aio_cancel();
+        return -1;
+}
+
+static int usb_write(char *buffer, size_t buffer_count)
+{
+        return kwrite(fb_in, buffer, buffer_count);
+}
+
+static int usb_read(char *buffer, size_t buffer_count)
+{
+        return read(fb_out, buffer, buffer_count);
+}
+
+static int usb_read_full(char *buffer, size_t buffer_count)
+{
+        if (usb_aio.enabled)
+                return usb_aio_read_full(buffer, buffer_count);
+
+        return kread_full(fb_out, buffer, buffer_count, FASTBOOT_READ_COUNT);
+}
+
+static int usb_init(void)
+{
+        int ret;
+
+        run_program("setup_fastboot", false);
+
+        fb_ep0 = open(USB_FASTBOOT_EP0, O_RDWR);
+        if (fb_ep0 == -1) {
+                log("open %s failed: %s\n", USB_FASTBOOT_EP0, strerror(errno));
+                return -1;
+        }
+
+        ret = kwrite(fb_ep0, (char *)&v2_descriptor, sizeof(v2_descriptor));
+        if (ret == -1) {
+                log("write usb descriptors failed\n");
+                return -1;
+        }
+
+        ret = kwrite(fb_ep0, (char *)&strings, sizeof(strings));
+        if (ret == -1) {
+                log("write usb strings failed\n");
+                return -1;
+        }
+
+        ret = write_to_file(USB_GADGET_UDC, MTK_USB_DRIVER, 12);
+        if (ret < 0) {
+                log("write usb gadget failed\n");
+                return -1;
+        }
+
+        fb_in = open(USB_FASTBOOT_IN, O_WRONLY);
+        if (fb_in == -1) {
+                log("open %s failed: %s\n", USB_FASTBOOT_IN, strerror(errno));
+                return -1;
+        }
+
+        fb_out = open(USB_FASTBOOT_OUT, O_RDONLY);
+        if (fb_out == -1) {
+                log("open %s failed: %s\n", USB_FASTBOOT_OUT, strerror(errno));
+                return -1;
+        }
+
+        if (usb_aio_init())
+                log("usb aio not available, fallback to synchronous reads\n");
+
+        return 0;
+}
+
+const struct fb_transport usb_transport = {
+        .name = "usb",
+        .init = usb_init,
+        .read = usb_read,
+        .write = usb_write,
+        .read_full = usb_read_full,
+};
@@ -6,16 +6,22 @@
 
 #include <errno.h>
 #include <linux/reboot.h>
-#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/reboot.h>
 #include <unistd.h>
 
+#include "autoboot.h"
 #include "boot.h"
+#include "erase.h"
 #include "fastboot.h"
+#include "flash.h"
+#include "hash.h"
 #include "part.h"
+#include "pool.h"
+#include "progress.h"
+#include "stream.h"
 #include "utils.h"
 
 #define MAX_DOWNLOAD_SIZE (256 * SZ_1M)
@@ -27,56 +33,96 @@ struct fb_cmd {
         fb_status (*handler)(char *args, char *rsp);
 };
 
+static fb_status cmd_boot(char *args, char *rsp);
 static fb_status cmd_continue(char *args, char *rsp);
 static fb_status cmd_download(char *args, char *rsp);
 static fb_status cmd_erase(char *args, char *rsp);
 static fb_status cmd_flash(char *args, char *rsp);
 static fb_status cmd_getvar(char *args, char *rsp);
+static fb_status cmd_oem(char *args, char *rsp);
 static fb_status cmd_reboot(char *args, char *rsp);
 
 static const struct fb_cmd cmds[] = {
-        {.command = "continue",  .handler = cmd_continue},
+        {.command = "boot",      .handler = cmd_boot    },
+        { .command = "continue", .handler = cmd_continue},
         { .command = "download", .handler = cmd_download},
         { .command = "erase",    .handler = cmd_erase   },
         { .command = "flash",    .handler = cmd_flash   },
         { .command = "getvar",   .handler = cmd_getvar  },
+        { .command = "oem",      .handler = cmd_oem     },
         { .command = "reboot",   .handler = cmd_reboot  },
 };
 
+static fb_status oem_autoboot(char *args, char *rsp);
+static fb_status oem_delta(char *args, char *rsp);
+static fb_status oem_dont_care(char *args, char *rsp);
+static fb_status oem_hash(char *args, char *rsp);
+static fb_status oem_stream(char *args, char *rsp);
+static fb_status oem_verify_flash(char *args, char *rsp);
+
+static const struct fb_cmd oem_cmds[] = {
+        {.command = "autoboot",      .handler = oem_autoboot    },
+        { .command = "delta",        .handler = oem_delta       },
+        { .command = "dont-care",    .handler = oem_dont_care   },
+        { .command = "hash",         .handler = oem_hash        },
+        { .command = "stream",       .handler = oem_stream      },
+        { .command = "verify-flash", .handler = oem_verify_flash},
+};
+
+static fb_status all_vars(char *args, char *rsp);
 static fb_status current_slot(char *args, char *rsp);
 static fb_status has_slot(char *args, char *rsp);
 static fb_status is_logical(char *args, char *rsp);
 static fb_status max_download_size(char *args, char *rsp);
+static fb_status partition_size(char *args, char *rsp);
+static fb_status partition_type(char *args, char *rsp);
 
 static const struct fb_cmd vars[] = {
-        {.command = "current-slot",       .handler = current_slot     },
+        {.command = "all",                .handler = all_vars         },
+        { .command = "current-slot",      .handler = current_slot     },
         { .command = "has-slot",          .handler = has_slot         },
         { .command = "is-logical",        .handler = is_logical       },
         { .command = "max-download-size", .handler = max_download_size},
+        { .command = "partition-size",    .handler = partition_size   },
+        { .command = "partition-type",    .handler = partition_type   },
 };
 
-struct flash_node {
-        char *path;
-        char *data;
-        size_t size;
-        struct flash_node *next;
+/* getvar all lists these once per partition */
+static const struct fb_cmd part_vars[] = {
+        {.command = "is-logical",      .handler = is_logical    },
+        { .command = "partition-size", .handler = partition_size},
+        { .command = "partition-type", .handler = partition_type},
 };
 
-static struct flash_node *flash_queue;
-static pthread_t flash_thread_id;
-static pthread_mutex_t flash_mutex;
-static bool flash_running;
+#define DOWNLOAD_QUEUE_LEN 16
 
 struct download_node {
         char *data;
-        int size;
-        struct download_node *next;
+        unsigned int size;
 };
 
-static struct download_node *download_queue;
+/* downloads waiting for a flash command, only used by the command loop */
+static struct download_node download_queue[DOWNLOAD_QUEUE_LEN];
+static unsigned int download_head;
+static unsigned int download_tail;
+
+/* partition the next download is streamed to (oem stream), flash:gpt may move it */
+static char stream_name[PART_NAME_SIZE];
+
+/* partition of the last flash, a new flash to it without other commands appends */
+static char *flash_append_name;
+
+/* read back and hash each flashed image (oem verify-flash) */
+static bool verify_flash;
 
 static bool fb_exit;
 
+static void flash_append_reset(void)
+{
+        free(flash_append_name);
+        flash_append_name = NULL;
+}
+
 static const struct fb_cmd *find_cmd(const struct fb_cmd *table, int table_size,
                                      char *cmd)
 {
@@ -121,49 +167,121 @@ static void fb_info(char *rsp)
         fb_response(INFO, rsp);
 }
 
-static void download_queue_add(char *data, int size)
+static int download_queue_add(char *data, unsigned int size)
 {
         struct download_node *node;
 
-        node = malloc(sizeof(struct download_node));
+        if (download_head - download_tail == DOWNLOAD_QUEUE_LEN) {
+                log("too many pending downloads\n");
+                return -1;
+        }
+
+        node = &download_queue[download_head++ % DOWNLOAD_QUEUE_LEN];
         node->data = data;
         node->size = size;
-        node->next = NULL;
 
-        if (download_queue == NULL) {
-                download_queue = node;
-        } else {
-                struct download_node *last = download_queue;
-                while (last->next)
-                        last = last->next;
-                last->next = node;
-        }
+        return 0;
 }
 
-static void download_queue_pop(char **data, int *size)
+static void download_queue_pop(char **data, unsigned int *size)
 {
         struct download_node *node;
 
-        if (download_queue == NULL)
+        if (download_head == download_tail)
                 return;
 
-        node = download_queue;
+        node = &download_queue[download_tail++ % DOWNLOAD_QUEUE_LEN];
         *data = node->data;
         *size = node->size;
+}
+
+/* INFO with the progress of a long operation, at most every PROGRESS_PERIOD_MS */
+static void fb_progress(struct progress *progress)
+{
+        char msg[256];
+
+        if (progress_report(progress, msg, sizeof(msg)))
+                fb_info(msg);
+}
+
+static void fb_progress_cb(void *priv, uint64_t done, uint64_t total)
+{
+        struct progress *progress = priv;
+
+        progress_set(progress, done, total);
+        fb_progress(progress);
+}
+
+/* wait for the flash worker, report failures of asynchronous flashes */
+static int fb_flash_wait(void)
+{
+        if (flash_busy())
+                fb_info("Waiting ongoing flash ...");
+
+        /* keep the host informed, a slow storage is not a hung device */
+        while (flash_wait_timeout(PROGRESS_PERIOD_MS))
+                fb_progress(flash_get_progress());
+
+        if (flash_wait_done()) {
+                fb_info("Previous flash failed");
+                return -1;
+        }
 
-        download_queue = node->next;
-        free(node);
+        return 0;
+}
+
+static fb_status download_stream(unsigned int buffer_size, char *rsp)
+{
+        struct part_info *info;
+        struct stream *stream;
+        int ret;
+
+        info = part_get_by_name(stream_name);
+        stream_name[0] = '\0';
+        if (!info) {
+                log("stream partition is gone\n");
+                return FAIL;
+        }
+
+        if (fb_flash_wait())
+                return FAIL;
+
+        /* once DATA is sent the host streams the payload, set up everything before */
+        stream = stream_open(info);
+        if (!stream)
+                return FAIL;
+
+        sprintf(rsp, "%08x", buffer_size);
+        fb_response(DATA, rsp);
+        memset(rsp, '\0', 256);
+
+        ret = stream_flash(stream, buffer_size);
+
+        return ret ? FAIL : OKAY;
 }
 
 static fb_status cmd_download(char *args, char *rsp)
 {
         char *data, *buffer;
-        int buffer_size;
+        unsigned int buffer_size;
 
         sscanf(args, "%08x", &buffer_size);
-        data = malloc(buffer_size);
-        if (data == NULL)
-                log("malloc failed: %s\n", strerror(errno));
+
+        if (stream_name[0])
+                return download_stream(buffer_size, rsp);
+
+        data = pool_alloc(buffer_size);
+        if (data == NULL && flash_busy()) {
+                /* the pool is recycled as soon as the flash releases it */
+                if (fb_flash_wait())
+                        return FAIL;
+                data = pool_alloc(buffer_size);
+        }
+
+        if (data == NULL) {
+                log("cannot allocate %u bytes for download\n", buffer_size);
+                return FAIL;
+        }
 
         sprintf(rsp, "%08x", buffer_size);
         fb_response(DATA, rsp);
@@ -171,11 +289,14 @@ static fb_status cmd_download(char *args, char *rsp)
 
         buffer = data;
         if (fastboot_read_full(buffer, buffer_size)) {
-                free(data);
+                pool_free(data);
                 return FAIL;
         }
 
-        download_queue_add(data, buffer_size);
+        if (download_queue_add(data, buffer_size)) {
+                pool_free(data);
+                return FAIL;
+        }
 
         return OKAY;
 }
@@ -196,177 +317,303 @@ static fb_status cmd_getvar(char *args, char *rsp)
         return status;
 }
 
+/* erase:<part>[,<part>...], each partition is erased as a whole */
 static fb_status cmd_erase(char *args, char *rsp)
 {
-        char *path;
-        uint64_t part_size;
-        int ret;
+        struct progress progress;
+        struct part_info *info;
+        char *name, *names;
+        char what[64];
 
-        path = part_get_path(args);
-        if (!path) {
-                log("cannot find partition: %s\n", args);
+        /* do not race with a pending flash of the same partition */
+        if (fb_flash_wait())
                 return FAIL;
-        }
 
-        /* For MMC0 no need to erase the whole partition */
-        if (!strcmp(path, MMC_BLK)) {
-                part_size = 4096;
-        } else {
-                part_size = part_get_size(path);
-                if (!part_size) {
-                        log("partition size returned 0: %s\n", args);
+        for (name = strtok_r(args, ",", &names); name; name = strtok_r(NULL, ",", &names)) {
+                info = part_get_by_name(name);
+                if (!info) {
+                        log("cannot find partition: %s\n", name);
                         return FAIL;
                 }
-        }
 
-        ret = part_erase(path, part_size);
+                snprintf(what, sizeof(what), "Erasing %s", name);
+                progress_start(&progress, what, 0);
 
-        return ret ? FAIL : OKAY;
+                if (erase_part(info, fb_progress_cb, &progress)) {
+                        snprintf(rsp, 256, "cannot erase %s", name);
+                        return FAIL;
+                }
+
+                progress_log(&progress);
+
+                /* the GPT was erased with the whole disk, drop its partitions */
+                if (!strcmp(info->path, MMC_BLK) && part_reload_gpt()) {
+                        snprintf(rsp, 256, "cannot reload the partition table");
+                        return FAIL;
+                }
+        }
+
+        return OKAY;
 }
 
-static void flash_queue_add(char *path, char *data, size_t size)
+static fb_status cmd_flash(char *args, char *rsp)
 {
-        struct flash_node *node;
+        static uint8_t digest[SHA256_DIGEST_SIZE];
+        struct flash_job job = { 0 };
+        struct part_info *info;
+        unsigned int size = 0;
+        char *data = NULL;
+        fb_status status;
 
-        node = malloc(sizeof(struct flash_node));
-        node->path = path;
-        node->data = data;
-        node->size = size;
-        node->next = NULL;
+        download_queue_pop(&data, &size);
+        if (data == NULL) {
+                log("no data downloaded\n");
+                return FAIL;
+        }
+
+        /* report errors (e.g. sparse CRC32 mismatch) of the flashes done so far */
+        if (flash_check()) {
+                fb_info("Previous flash failed");
+                pool_free(data);
+                return FAIL;
+        }
 
-        pthread_mutex_lock(&flash_mutex);
+        /* the partition table is switched synchronously, no partition may be in use */
+        if (!strcmp(args, "gpt")) {
+                flash_append_reset();
+                status = (fb_flash_wait() || part_update_gpt(data, size)) ? FAIL : OKAY;
+                pool_free(data);
+                return status;
+        }
 
-        if (flash_queue == NULL) {
-                flash_queue = node;
-        } else {
-                struct flash_node *last = flash_queue;
-                while (last->next)
-                        last = last->next;
-                last->next = node;
+        info = part_get_by_name(args);
+        if (!info) {
+                log("cannot find partition: %s\n", args);
+                pool_free(data);
+                return FAIL;
+        }
+
+        job.part = info;
+        job.data = data;
+        job.size = size;
+        job.append = flash_append_name && !strcmp(flash_append_name, args);
+
+        free(flash_append_name);
+        flash_append_name = strdup(args);
+
+        if (!verify_flash) {
+                flash_queue(&job);
+                return OKAY;
         }
 
-        pthread_mutex_unlock(&flash_mutex);
+        /* verified flashes are synchronous to report the digest */
+        job.verify = true;
+        job.digest = digest;
+        flash_queue(&job);
+
+        if (fb_flash_wait())
+                return FAIL;
+
+        sha256_hex(digest, rsp);
+        fb_info(rsp);
+
+        return OKAY;
 }
 
-static void flash_queue_pop(char **path, char **data, size_t *size)
+/* boot the downloaded image without writing it to storage */
+static fb_status cmd_boot(char *args, char *rsp)
 {
-        struct flash_node *node;
+        struct progress progress;
+        unsigned int size = 0;
+        char *data = NULL;
+        int ret;
 
-        if (flash_queue == NULL)
-                return;
+        download_queue_pop(&data, &size);
+        if (data == NULL) {
+                log("no data downloaded\n");
+                return FAIL;
+        }
 
-        pthread_mutex_lock(&flash_mutex);
+        /* the flashes queued before must be done when the next kernel starts */
+        if (fb_flash_wait()) {
+                pool_free(data);
+                return FAIL;
+        }
 
-        node = flash_queue;
-        *path = node->path;
-        *data = node->data;
-        *size = node->size;
+        /* only the image is needed from now on, leave the memory to the next kernel */
+        pool_release();
 
-        flash_queue = node->next;
-        free(node);
+        progress_start(&progress, "Loading boot image", 0);
+        ret = boot_ram(data, size, fb_progress_cb, &progress);
+        pool_free(data);
 
-        pthread_mutex_unlock(&flash_mutex);
+        if (ret) {
+                snprintf(rsp, 256, "cannot load boot image");
+                return FAIL;
+        }
+
+        progress_log(&progress);
+
+        fb_exit = true;
+
+        return OKAY;
 }
 
-static void *flash_thread(void *arg)
+static fb_status cmd_continue(char *args, char *rsp)
 {
-        char *path, *current_path = NULL, *data;
-        uint64_t offset;
-        size_t size;
+        struct progress progress;
 
-        pthread_mutex_lock(&flash_mutex);
-        flash_running = true;
-        pthread_mutex_unlock(&flash_mutex);
+        if (fb_flash_wait())
+                return FAIL;
 
-        while (1) {
-                path = NULL;
-                data = NULL;
-                size = 0;
+        pool_release();
 
-                flash_queue_pop(&path, &data, &size);
-                if (path == NULL)
-                        break;
+        progress_start(&progress, "Loading boot image", 0);
+        if (!boot_android(fb_progress_cb, &progress))
+                progress_log(&progress);
 
-                if (current_path == NULL) {
-                        current_path = strdup(path);
-                        offset = 0;
-                } else if (strcmp(current_path, path)) {
-                        offset = 0;
-                        free(current_path);
-                        current_path = strdup(path);
-                }
+        fb_exit = true;
 
-                part_flash(path, data, &offset, size);
+        return OKAY;
+}
 
-                free(data);
-        };
+static fb_status cmd_oem(char *args, char *rsp)
+{
+        const struct fb_cmd *fb_oem;
+        char *cmd, *args2;
+        fb_status status = FAIL;
 
-        if (current_path)
-                free(current_path);
+        cmd = strtok_r(args, ": ", &args2);
+        if (!cmd)
+                return FAIL;
 
-        pthread_mutex_lock(&flash_mutex);
-        flash_running = false;
-        pthread_mutex_unlock(&flash_mutex);
+        fb_oem = find_cmd(oem_cmds, ARRAY_SIZE(oem_cmds), cmd);
+        if (fb_oem)
+                status = fb_oem->handler(args2, rsp);
+        else
+                log("oem: %s not supported\n", cmd);
 
-        return NULL;
+        return status;
 }
 
-static void flash_start_thread(void)
+/* oem autoboot <seconds>|default, countdown before booting this device */
+static fb_status oem_autoboot(char *args, char *rsp)
 {
-        if (pthread_create(&flash_thread_id, NULL, flash_thread, NULL))
-                log("cannot create flash thread\n");
+        char *end;
+        long delay;
+
+        if (!strcmp(args, "default")) {
+                delay = -1;
+        } else {
+                delay = strtol(args, &end, 10);
+                if (end == args || *end || delay < 0 || delay > AUTOBOOT_MAX_DELAY) {
+                        snprintf(rsp, 256, "delay must be 0-%d or default",
+                                 AUTOBOOT_MAX_DELAY);
+                        return FAIL;
+                }
+        }
+
+        return autoboot_set_delay(delay) ? FAIL : OKAY;
 }
 
-static void flash_wait_done(void)
+static fb_status oem_delta(char *args, char *rsp)
 {
-        pthread_join(flash_thread_id, NULL);
+        if (!strcmp(args, "on"))
+                part_set_delta(true);
+        else if (!strcmp(args, "off"))
+                part_set_delta(false);
+        else
+                return FAIL;
+
+        return OKAY;
 }
 
-static fb_status cmd_flash(char *args, char *rsp)
+static fb_status oem_dont_care(char *args, char *rsp)
 {
-        char *path, *data = NULL;
-        int size = 0;
+        /* what to do with the regions skipped by sparse DONT_CARE chunks */
+        if (!strcmp(args, "discard"))
+                part_set_discard_dont_care(true);
+        else if (!strcmp(args, "skip"))
+                part_set_discard_dont_care(false);
+        else
+                return FAIL;
 
-        download_queue_pop(&data, &size);
-        if (data == NULL) {
-                log("no data downloaded\n");
+        return OKAY;
+}
+
+/* oem hash:<partition>[:<offset>:<size>], SHA-256 of the partition content */
+static fb_status oem_hash(char *args, char *rsp)
+{
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        uint64_t offset = 0, size, part_size;
+        char *name, *off, *len, *save;
+        struct part_info *info;
+
+        name = strtok_r(args, ":", &save);
+        off = strtok_r(NULL, ":", &save);
+        len = strtok_r(NULL, ":", &save);
+
+        info = name ? part_get_by_name(name) : NULL;
+        if (!info) {
+                log("cannot find partition: %s\n", name ? name : "");
                 return FAIL;
         }
 
-        path = part_get_path(args);
-        if (!path) {
-                log("cannot find partition: %s\n", args);
+        part_size = info->size;
+        size = part_size;
+
+        if (off) {
+                offset = strtoull(off, NULL, 0);
+                size = len ? strtoull(len, NULL, 0) : part_size - MIN(offset, part_size);
+        }
+
+        if (offset > part_size || size > part_size - offset) {
+                log("hash range exceeds partition size\n");
                 return FAIL;
         }
 
-        flash_queue_add(strdup(path), data, size);
+        /* hash what the pending flashes are writing */
+        if (fb_flash_wait())
+                return FAIL;
 
-        if (!flash_running)
-                flash_start_thread();
+        if (hash_part(info, offset, size, digest))
+                return FAIL;
+
+        sha256_hex(digest, rsp);
+        fb_info(rsp);
 
         return OKAY;
 }
 
-static fb_status cmd_continue(char *args, char *rsp)
+static fb_status oem_stream(char *args, char *rsp)
 {
-        if (flash_running) {
-                fb_info("Waiting ongoing flash ...");
-                flash_wait_done();
+        if (!part_get_path(args)) {
+                log("cannot find partition: %s\n", args);
+                return FAIL;
         }
 
-        boot_android();
+        /* the next download is flashed to this partition while it is received */
+        snprintf(stream_name, sizeof(stream_name), "%s", args);
 
-        fb_exit = true;
+        return OKAY;
+}
+
+static fb_status oem_verify_flash(char *args, char *rsp)
+{
+        if (!strcmp(args, "on"))
+                verify_flash = true;
+        else if (!strcmp(args, "off"))
+                verify_flash = false;
+        else
+                return FAIL;
 
         return OKAY;
 }
 
 static fb_status cmd_reboot(char *args, char *rsp)
 {
-        if (flash_running) {
-                fb_info("Waiting ongoing flash ...");
-                flash_wait_done();
-        }
+        if (fb_flash_wait())
+                return FAIL;
 
         fb_okay("");
         reboot(LINUX_REBOOT_CMD_RESTART);
@@ -400,9 +647,88 @@ static fb_status is_logical(char *args, char *rsp)
         return OKAY;
 }
 
+static struct part_info *part_by_name(char *name)
+{
+        struct part_info *info = name ? part_get_by_name(name) : NULL;
+
+        if (!info)
+                log("cannot find partition: %s\n", name ? name : "");
+
+        return info;
+}
+
+static fb_status partition_size(char *args, char *rsp)
+{
+        struct part_info *info = part_by_name(args);
+
+        if (!info)
+                return FAIL;
+
+        sprintf(rsp, "0x%016llx", (unsigned long long)info->size);
+
+        return OKAY;
+}
+
+static fb_status partition_type(char *args, char *rsp)
+{
+        struct part_info *info = part_by_name(args);
+
+        if (!info)
+                return FAIL;
+
+        sprintf(rsp, "%s", part_get_type(info));
+
+        return OKAY;
+}
+
+/* every variable is sent as an INFO "<name>:<value>" line */
+static fb_status all_vars(char *args, char *rsp)
+{
+        char value[64], info[256];
+        struct part_info *part;
+
+        for (int i = 0; i < ARRAY_SIZE(vars); i++) {
+                if (vars[i].handler == all_vars || find_cmd(part_vars, ARRAY_SIZE(part_vars),
+                                                            (char *)vars[i].command))
+                        continue;
+
+                /* has-slot asks about a partition without its suffix */
+                if (vars[i].handler == has_slot)
+                        continue;
+
+                memset(value, '\0', sizeof(value));
+                if (vars[i].handler(NULL, value) == OKAY) {
+                        snprintf(info, sizeof(info), "%s:%s", vars[i].command, value);
+                        fb_info(info);
+                }
+        }
+
+        for (unsigned int i = 0; i < part_count(); i++) {
+                part = part_get_index(i);
+
+                for (int j = 0; j < ARRAY_SIZE(part_vars); j++) {
+                        memset(value, '\0', sizeof(value));
+                        if (part_vars[j].handler(part->name, value) != OKAY)
+                                continue;
+
+                        snprintf(info, sizeof(info), "%s:%s:%s", part_vars[j].command,
+                                 part->name, value);
+                        fb_info(info);
+                }
+        }
+
+        return OKAY;
+}
+
 static fb_status max_download_size(char *args, char *rsp)
 {
-        unsigned long mem = mem_avail() / 3 * 2;
+        /* streamed downloads are not held in RAM, only the protocol limits them */
+        if (stream_name[0]) {
+                sprintf(rsp, "%u", UINT32_MAX);
+                return OKAY;
+        }
+
+        unsigned long mem = pool_size() ? pool_size() : mem_avail() / 3 * 2;
         unsigned long max = mem < MAX_DOWNLOAD_SIZE ? mem : MAX_DOWNLOAD_SIZE;
 
         sprintf(rsp, "%ld", max);
@@ -410,6 +736,11 @@ static fb_status max_download_size(char *args, char *rsp)
         return OKAY;
 }
 
+int fb_command_init(void)
+{
+        return flash_init();
+}
+
 void fb_command_loop(void)
 {
         char buffer[256] = { '\0' };
@@ -420,8 +751,6 @@ void fb_command_loop(void)
         size_t count_read;
 
         fb_exit = false;
-        flash_running = false;
-        pthread_mutex_init(&flash_mutex, NULL);
 
         log("wait fastboot commands ...\n");
 
@@ -438,7 +767,16 @@ void fb_command_loop(void)
                 buffer[count_read] = '\0';
                 log("%s\n", buffer);
 
-                cmd = strtok_r(buffer, ":", &args);
+                cmd = strtok_r(buffer, ": ", &args);
+                if (!cmd) {
+                        fb_response(FAIL, rsp);
+                        continue;
+                }
+
+                /* only downloads may come between the parts of a split image */
+                if (strcmp(cmd, "flash") && strcmp(cmd, "download"))
+                        flash_append_reset();
+
                 fb_cmd = find_cmd(cmds, ARRAY_SIZE(cmds), cmd);
                 if (fb_cmd)
                         status = fb_cmd->handler(args, rsp);
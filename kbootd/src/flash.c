@@ -0,0 +1,238 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flash.h"
+#include "hash.h"
+#include "part.h"
+#include "pool.h"
+#include "progress.h"
+#include "sparse.h"
+#include "utils.h"
+
+#define FLASH_QUEUE_LEN  16
+#define FLASH_SLICE_SIZE (16 * SZ_1M)
+
+/*
+ * Single producer (command loop) / single consumer (flash worker) ring.
+ * head and tail are only written by their owner, the semaphores provide the
+ * wakeups: flash_items counts queued jobs and flash_slots free entries.
+ */
+static struct flash_job flash_jobs[FLASH_QUEUE_LEN];
+static atomic_uint flash_head;
+static atomic_uint flash_tail;
+static sem_t flash_items;
+static sem_t flash_slots;
+
+/* jobs completed since init and failed since the last flash_wait_done */
+static atomic_uint flash_completed;
+static atomic_uint flash_errors;
+static sem_t flash_done;
+
+/* bytes written out of the bytes queued since the worker was last idle */
+static struct progress flash_progress;
+
+static pthread_t flash_thread_id;
+
+/*
+ * Read back what was just written. Raw images are compared with the
+ * downloaded data, sparse and compressed images only get the digest of their
+ * output range reported: DONT_CARE regions have no expected content and the
+ * decompressed data is gone.
+ */
+static int flash_verify(struct flash_job *job, struct part_stream *stream)
+{
+        uint8_t expected[SHA256_DIGEST_SIZE];
+        uint64_t start, end;
+        bool compare;
+
+        part_stream_extent(stream, &start, &end);
+
+        compare = !part_stream_compressed(stream) &&
+                  !(job->size >= sizeof(struct sparse_header) && sparse_image(job->data));
+        if (compare)
+                sha256(job->data, job->size, expected);
+
+        if (hash_part(job->part, start, end - start, job->digest)) {
+                log("read back %s failed\n", job->part->name);
+                return -1;
+        }
+
+        if (compare && memcmp(expected, job->digest, SHA256_DIGEST_SIZE)) {
+                log("read back %s mismatch\n", job->part->name);
+                return -1;
+        }
+
+        return 0;
+}
+
+static int flash_image(struct flash_job *job, char **current_path, uint64_t *offset)
+{
+        struct part_stream *stream;
+        size_t done, count;
+        int ret = -1;
+
+        /* split raw images are flashed back to back on the same partition */
+        if (!job->append || *current_path == NULL || strcmp(*current_path, job->part->path)) {
+                free(*current_path);
+                *current_path = strdup(job->part->path);
+                *offset = 0;
+        }
+
+        stream = part_stream_open(job->part, *offset);
+        if (stream) {
+                /* write in slices to report progress on large images */
+                ret = 0;
+                for (done = 0; done < job->size; done += count) {
+                        count = MIN(job->size - done, FLASH_SLICE_SIZE);
+                        ret = part_stream_write(stream, job->data + done, count);
+                        if (ret)
+                                break;
+                        progress_add(&flash_progress, count, 0);
+                }
+
+                if (!ret && job->verify)
+                        ret = flash_verify(job, stream);
+
+                if (part_stream_close(stream, offset))
+                        ret = -1;
+        }
+
+        if (ret)
+                log("flash %s failed\n", job->part->name);
+
+        pool_free(job->data);
+
+        return ret;
+}
+
+static void *flash_thread(void *arg)
+{
+        char *current_path = NULL;
+        struct flash_job *job;
+        uint64_t offset = 0;
+        unsigned int tail;
+        int ret;
+
+        while (1) {
+                sem_wait(&flash_items);
+
+                tail = atomic_load_explicit(&flash_tail, memory_order_relaxed);
+                job = &flash_jobs[tail % FLASH_QUEUE_LEN];
+
+                if (job->stream) {
+                        ret = part_stream_write(job->stream, job->data, job->size);
+                        progress_add(&flash_progress, job->size, 0);
+                } else {
+                        ret = flash_image(job, &current_path, &offset);
+                }
+
+                /* with a completion callback the status belongs to the submitter */
+                if (job->done)
+                        job->done(job, ret);
+                else if (ret)
+                        atomic_fetch_add(&flash_errors, 1);
+
+                atomic_store_explicit(&flash_tail, tail + 1, memory_order_release);
+                sem_post(&flash_slots);
+
+                /* the queue is drained, log the throughput of the burst */
+                if (atomic_load(&flash_completed) + 1 == atomic_load(&flash_head))
+                        progress_log(&flash_progress);
+
+                atomic_fetch_add(&flash_completed, 1);
+                sem_post(&flash_done);
+        }
+
+        return NULL;
+}
+
+void flash_queue(struct flash_job *job)
+{
+        unsigned int head;
+
+        sem_wait(&flash_slots);
+
+        if (!flash_busy())
+                progress_start(&flash_progress, "Flashing", 0);
+        progress_add(&flash_progress, 0, job->size);
+
+        head = atomic_load_explicit(&flash_head, memory_order_relaxed);
+        flash_jobs[head % FLASH_QUEUE_LEN] = *job;
+        atomic_store_explicit(&flash_head, head + 1, memory_order_release);
+
+        sem_post(&flash_items);
+}
+
+bool flash_busy(void)
+{
+        return atomic_load(&flash_completed) != atomic_load(&flash_head);
+}
+
+/* wait up to timeout_ms for the queued jobs, returns true if some are still running */
+bool flash_wait_timeout(unsigned int timeout_ms)
+{
+        struct timespec timeout;
+
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_sec += timeout_ms / 1000;
+        timeout.tv_nsec += (timeout_ms % 1000) * 1000000;
+        if (timeout.tv_nsec >= 1000000000) {
+                timeout.tv_sec++;
+                timeout.tv_nsec -= 1000000000;
+        }
+
+        while (flash_busy()) {
+                if (sem_timedwait(&flash_done, &timeout) && errno == ETIMEDOUT)
+                        return flash_busy();
+        }
+
+        return false;
+}
+
+struct progress *flash_get_progress(void)
+{
+        return &flash_progress;
+}
+
+int flash_wait_done(void)
+{
+        while (flash_busy())
+                sem_wait(&flash_done);
+
+        /* drop the wakeups of the jobs we did not wait for */
+        while (!sem_trywait(&flash_done))
+                ;
+
+        return flash_check();
+}
+
+int flash_check(void)
+{
+        return atomic_exchange(&flash_errors, 0) ? -1 : 0;
+}
+
+int flash_init(void)
+{
+        sem_init(&flash_items, 0, 0);
+        sem_init(&flash_slots, 0, FLASH_QUEUE_LEN);
+        sem_init(&flash_done, 0, 0);
+
+        if (pthread_create(&flash_thread_id, NULL, flash_thread, NULL)) {
+                log("cannot create flash thread\n");
+                return -1;
+        }
+
+        return 0;
+}
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#ifndef FLASH_H
+#define FLASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct part_info;
+struct part_stream;
+struct progress;
+
+/*
+ * A flash job either writes a whole downloaded image to part (data is
+ * released by the worker) or a fragment of an image to an opened stream.
+ * The partition table is only rebuilt once the worker is idle, part stays
+ * valid until the job is done.
+ * done, when set, is called by the worker with the job status.
+ * With append, the image continues the previous one flashed to the same partition
+ * (split raw images), else it is written from offset 0.
+ * With verify, an image is read back once written and its SHA-256 is stored
+ * in digest.
+ */
+struct flash_job {
+        struct part_info *part;
+        struct part_stream *stream;
+        char *data;
+        size_t size;
+        bool append;
+        bool verify;
+        uint8_t *digest;
+        void (*done)(struct flash_job *job, int status);
+        void *priv;
+};
+
+int flash_init(void);
+void flash_queue(struct flash_job *job);
+bool flash_busy(void);
+bool flash_wait_timeout(unsigned int timeout_ms);
+int flash_wait_done(void);
+struct progress *flash_get_progress(void);
+int flash_check(void);
+
+#endif
@@ -0,0 +1,481 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <errno.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "gpt.h"
+#include "utils.h"
+
+/* protective MBR, header and the usual 128 entries of 128 bytes */
+#define GPT_READ_LBAS 34
+
+/*
+ * In-memory copy of the GPT, loaded by gpt_load at init and again once the
+ * whole disk was rewritten. Both headers are kept, the entry array is shared:
+ * they only differ by their location. Changes are made in memory and written
+ * back to both copies by gpt_flush.
+ */
+static struct {
+        int fd;
+        uint64_t last_lba;
+        struct gpt_header primary;
+        struct gpt_header backup;
+        char *entries;
+        size_t entries_size;
+        bool dirty;
+        pthread_mutex_t mutex;
+} gpt = {
+        .fd = -1,
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int mbr_valid(const uint8_t *mbr)
+{
+        return (mbr[510] == 0x55 && mbr[511] == 0xaa);
+}
+
+static int gpt_pread(void *data, size_t size, uint64_t lba)
+{
+        char *ptr = data;
+        ssize_t count;
+        off_t offset = lba * LBA_SIZE;
+
+        while (size) {
+                count = pread(gpt.fd, ptr, size, offset);
+                if (count == -1 && errno == EINTR)
+                        continue;
+
+                if (count <= 0) {
+                        log("read GPT at LBA %llu failed\n", (unsigned long long)lba);
+                        return -1;
+                }
+
+                ptr += count;
+                offset += count;
+                size -= count;
+        }
+
+        return 0;
+}
+
+static int gpt_pwrite(const void *data, size_t size, uint64_t lba)
+{
+        const char *ptr = data;
+        ssize_t count;
+        off_t offset = lba * LBA_SIZE;
+
+        while (size) {
+                count = pwrite(gpt.fd, ptr, size, offset);
+                if (count == -1 && errno == EINTR)
+                        continue;
+
+                if (count <= 0) {
+                        log("write GPT at LBA %llu failed: %s\n", (unsigned long long)lba,
+                            strerror(errno));
+                        return -1;
+                }
+
+                ptr += count;
+                offset += count;
+                size -= count;
+        }
+
+        return 0;
+}
+
+static uint32_t gpt_header_crc(struct gpt_header *hdr)
+{
+        struct gpt_header tmp = *hdr;
+
+        tmp.hdr_crc32 = 0;
+
+        return crc32_update(0, &tmp, sizeof(struct gpt_header));
+}
+
+static size_t gpt_array_size(struct gpt_header *hdr)
+{
+        return (size_t)hdr->n_parts * hdr->part_entry_len;
+}
+
+static size_t gpt_array_lbas(struct gpt_header *hdr)
+{
+        return DIV_ROUND_UP(gpt_array_size(hdr), LBA_SIZE);
+}
+
+static bool gpt_header_valid(struct gpt_header *hdr, uint64_t lba)
+{
+        /* the CRC covers hdr_size bytes, only the known fields are kept */
+        if (hdr->magic != GPT_MAGIC || hdr->hdr_size != sizeof(struct gpt_header) ||
+            hdr->current_lba != lba)
+                return false;
+
+        if (hdr->part_entry_len < sizeof(struct gpt_entry) || !hdr->n_parts ||
+            gpt_array_size(hdr) > SZ_1M)
+                return false;
+
+        return gpt_header_crc(hdr) == hdr->hdr_crc32;
+}
+
+/*
+ * Read a header and its entries, window is the GPT_READ_LBAS already read
+ * from first_lba. Returns the entries, or NULL if this copy is corrupted.
+ */
+static char *gpt_load_copy(struct gpt_header *hdr, char *window, uint64_t first_lba,
+                           uint64_t lba)
+{
+        uint64_t array_lba;
+        size_t array_lbas;
+        char *entries;
+
+        memcpy(hdr, window + (lba - first_lba) * LBA_SIZE, sizeof(struct gpt_header));
+        if (!gpt_header_valid(hdr, lba))
+                return NULL;
+
+        array_lba = hdr->first_part_lba;
+        array_lbas = gpt_array_lbas(hdr);
+
+        entries = malloc(array_lbas * LBA_SIZE);
+        if (!entries)
+                return NULL;
+
+        /* the entries usually are in the window, else read them in one go */
+        if (array_lba >= first_lba && array_lba + array_lbas <= first_lba + GPT_READ_LBAS)
+                memcpy(entries, window + (array_lba - first_lba) * LBA_SIZE,
+                       array_lbas * LBA_SIZE);
+        else if (gpt_pread(entries, array_lbas * LBA_SIZE, array_lba)) {
+                free(entries);
+                return NULL;
+        }
+
+        if (crc32_update(0, entries, gpt_array_size(hdr)) != hdr->part_array_crc32) {
+                free(entries);
+                return NULL;
+        }
+
+        return entries;
+}
+
+/* a header for the other copy location, its CRCs are set by gpt_flush */
+static void gpt_header_mirror(struct gpt_header *dst, struct gpt_header *src, bool primary)
+{
+        *dst = *src;
+        dst->current_lba = src->backup_lba;
+        dst->backup_lba = src->current_lba;
+        dst->first_part_lba = primary ? 2 : src->backup_lba - gpt_array_lbas(src);
+}
+
+int gpt_load(int fd)
+{
+        char *window, *primary, *backup;
+        uint64_t size, backup_lba, backup_first;
+
+        /* a reload starts from scratch, a disk without GPT has no entries */
+        pthread_mutex_lock(&gpt.mutex);
+        free(gpt.entries);
+        gpt.entries = NULL;
+        gpt.entries_size = 0;
+        gpt.dirty = false;
+        pthread_mutex_unlock(&gpt.mutex);
+
+        gpt.fd = fd;
+
+        if (ioctl(fd, BLKGETSIZE64, &size) || size < 2 * GPT_READ_LBAS * LBA_SIZE) {
+                log("cannot get disk size\n");
+                return -1;
+        }
+        gpt.last_lba = size / LBA_SIZE - 1;
+
+        window = malloc(GPT_READ_LBAS * LBA_SIZE);
+        if (!window)
+                return -1;
+
+        /* protective MBR, primary header and entries */
+        if (gpt_pread(window, GPT_READ_LBAS * LBA_SIZE, 0)) {
+                free(window);
+                return -1;
+        }
+
+        if (!mbr_valid((uint8_t *)window)) {
+                log("invalid MBR\n");
+                free(window);
+                return -1;
+        }
+
+        primary = gpt_load_copy(&gpt.primary, window, 0, 1);
+
+        /* backup entries and header, at the end of the disk */
+        backup_lba = primary ? gpt.primary.backup_lba : gpt.last_lba;
+        backup = NULL;
+        if (backup_lba >= GPT_READ_LBAS && backup_lba <= gpt.last_lba) {
+                backup_first = backup_lba + 1 - GPT_READ_LBAS;
+                if (!gpt_pread(window, GPT_READ_LBAS * LBA_SIZE, backup_first))
+                        backup = gpt_load_copy(&gpt.backup, window, backup_first,
+                                               backup_lba);
+        }
+
+        free(window);
+
+        if (!primary && !backup) {
+                log("invalid GPT header\n");
+                return -1;
+        }
+
+        if (!primary) {
+                log("primary GPT corrupted, using the backup\n");
+                gpt_header_mirror(&gpt.primary, &gpt.backup, true);
+                gpt.dirty = true;
+        } else if (!backup) {
+                log("backup GPT corrupted\n");
+                gpt_header_mirror(&gpt.backup, &gpt.primary, false);
+                gpt.dirty = true;
+        }
+
+        gpt.entries = primary ? primary : backup;
+        gpt.entries_size = gpt_array_lbas(&gpt.primary) * LBA_SIZE;
+        if (primary && backup)
+                free(backup);
+
+        /* restore the corrupted copy from the valid one */
+        if (gpt.dirty && gpt_flush())
+                log("cannot restore the GPT\n");
+
+        return 0;
+}
+
+unsigned int gpt_count(void)
+{
+        return gpt.entries ? gpt.primary.n_parts : 0;
+}
+
+struct gpt_entry *gpt_get_entry(unsigned int index)
+{
+        if (index >= gpt_count())
+                return NULL;
+
+        return (struct gpt_entry *)(gpt.entries + index * gpt.primary.part_entry_len);
+}
+
+/* UTF-16LE partition name, non printable characters are replaced */
+void gpt_entry_name(struct gpt_entry *entry, char *name, size_t size)
+{
+        uint16_t c;
+        size_t i;
+
+        for (i = 0; i < size - 1 && i < PARTNAME_SZ / 2; i++) {
+                c = entry->partition_name[2 * i] | entry->partition_name[2 * i + 1] << 8;
+                if (!c)
+                        break;
+                name[i] = (0x20 <= c && c < 0x7f) ? c : '?';
+        }
+        name[i] = '\0';
+}
+
+struct gpt_entry *gpt_find(const char *name)
+{
+        char part[PARTNAME_SZ / 2 + 1];
+        struct gpt_entry *entry;
+
+        for (unsigned int i = 0; i < gpt_count(); i++) {
+                entry = gpt_get_entry(i);
+                if (!entry->starting_lba)
+                        continue;
+
+                gpt_entry_name(entry, part, sizeof(part));
+                if (!strcmp(part, name))
+                        return entry;
+        }
+
+        return NULL;
+}
+
+/* used entries must be in the usable range and must not overlap */
+static int gpt_entries_valid(struct gpt_header *hdr, const char *entries)
+{
+        const struct gpt_entry *a, *b;
+
+        for (unsigned int i = 0; i < hdr->n_parts; i++) {
+                a = (const struct gpt_entry *)(entries + i * hdr->part_entry_len);
+                if (!a->starting_lba)
+                        continue;
+
+                if (a->starting_lba < hdr->first_usable_lba ||
+                    a->ending_lba > hdr->last_usable_lba || a->starting_lba > a->ending_lba) {
+                        log("partition %u does not fit in the disk\n", i + 1);
+                        return -1;
+                }
+
+                for (unsigned int j = 0; j < i; j++) {
+                        b = (const struct gpt_entry *)(entries + j * hdr->part_entry_len);
+                        if (b->starting_lba && a->starting_lba <= b->ending_lba &&
+                            b->starting_lba <= a->ending_lba) {
+                                log("partitions %u and %u overlap\n", j + 1, i + 1);
+                                return -1;
+                        }
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * Replace the table by an uploaded one: protective MBR, primary header and
+ * entries, as found at the start of a disk. The backup copy is placed at the
+ * end of this disk, the disk MBR is kept.
+ */
+int gpt_replace(const char *data, size_t size)
+{
+        struct gpt_header hdr;
+        size_t array_lbas;
+        const char *array;
+        char *entries;
+
+        if (size < 2 * LBA_SIZE || !mbr_valid((const uint8_t *)data)) {
+                log("invalid GPT image\n");
+                return -1;
+        }
+
+        memcpy(&hdr, data + LBA_SIZE, sizeof(struct gpt_header));
+        if (!gpt_header_valid(&hdr, 1)) {
+                log("invalid GPT header\n");
+                return -1;
+        }
+
+        array_lbas = gpt_array_lbas(&hdr);
+        if (hdr.first_part_lba < 2 || array_lbas > size / LBA_SIZE ||
+            hdr.first_part_lba > size / LBA_SIZE - array_lbas) {
+                log("GPT entries are not in the image\n");
+                return -1;
+        }
+
+        array = data + hdr.first_part_lba * LBA_SIZE;
+        if (crc32_update(0, array, gpt_array_size(&hdr)) != hdr.part_array_crc32) {
+                log("GPT entries CRC mismatch\n");
+                return -1;
+        }
+
+        /* the image may be built for another disk size */
+        if (gpt.last_lba < 2 * (array_lbas + 1)) {
+                log("GPT does not fit in the disk\n");
+                return -1;
+        }
+        hdr.backup_lba = gpt.last_lba;
+        hdr.last_usable_lba = gpt.last_lba - array_lbas - 1;
+
+        if (hdr.first_usable_lba < hdr.first_part_lba + array_lbas ||
+            hdr.first_usable_lba > hdr.last_usable_lba) {
+                log("invalid GPT usable range\n");
+                return -1;
+        }
+
+        if (gpt_entries_valid(&hdr, array))
+                return -1;
+
+        entries = calloc(array_lbas, LBA_SIZE);
+        if (!entries)
+                return -1;
+        memcpy(entries, array, gpt_array_size(&hdr));
+
+        pthread_mutex_lock(&gpt.mutex);
+
+        free(gpt.entries);
+        gpt.entries = entries;
+        gpt.entries_size = array_lbas * LBA_SIZE;
+        gpt.primary = hdr;
+        gpt_header_mirror(&gpt.backup, &gpt.primary, false);
+        gpt.dirty = true;
+
+        pthread_mutex_unlock(&gpt.mutex);
+
+        return gpt_flush();
+}
+
+void gpt_lock(void)
+{
+        pthread_mutex_lock(&gpt.mutex);
+}
+
+/* entries were changed in memory */
+void gpt_unlock(bool dirty)
+{
+        if (dirty)
+                gpt.dirty = true;
+        pthread_mutex_unlock(&gpt.mutex);
+}
+
+/* entries and header of one copy, with a single write when they are contiguous */
+static int gpt_write_copy(struct gpt_header *hdr, char *buffer)
+{
+        size_t array_lbas = gpt.entries_size / LBA_SIZE;
+        char header[LBA_SIZE] = { 0 };
+
+        memcpy(header, hdr, sizeof(struct gpt_header));
+
+        if (hdr->first_part_lba + array_lbas == hdr->current_lba) {
+                memcpy(buffer, gpt.entries, gpt.entries_size);
+                memcpy(buffer + gpt.entries_size, header, LBA_SIZE);
+                return gpt_pwrite(buffer, (array_lbas + 1) * LBA_SIZE, hdr->first_part_lba);
+        }
+
+        if (hdr->current_lba + 1 == hdr->first_part_lba) {
+                memcpy(buffer, header, LBA_SIZE);
+                memcpy(buffer + LBA_SIZE, gpt.entries, gpt.entries_size);
+                return gpt_pwrite(buffer, (array_lbas + 1) * LBA_SIZE, hdr->current_lba);
+        }
+
+        if (gpt_pwrite(gpt.entries, gpt.entries_size, hdr->first_part_lba))
+                return -1;
+
+        return gpt_pwrite(header, LBA_SIZE, hdr->current_lba);
+}
+
+/*
+ * Write both copies back: the backup first, then the primary, each synced
+ * before the next one. A power loss leaves at least one copy with valid CRCs.
+ */
+int gpt_flush(void)
+{
+        struct gpt_header *primary = &gpt.primary, *backup = &gpt.backup;
+        char *buffer;
+        int ret = -1;
+
+        pthread_mutex_lock(&gpt.mutex);
+
+        if (!gpt.dirty) {
+                pthread_mutex_unlock(&gpt.mutex);
+                return 0;
+        }
+
+        primary->part_array_crc32 = crc32_update(0, gpt.entries, gpt_array_size(primary));
+        primary->hdr_crc32 = gpt_header_crc(primary);
+        backup->part_array_crc32 = primary->part_array_crc32;
+        backup->hdr_crc32 = gpt_header_crc(backup);
+
+        buffer = malloc(gpt.entries_size + LBA_SIZE);
+        if (!buffer)
+                goto exit;
+
+        if (gpt_write_copy(backup, buffer) || fsync(gpt.fd))
+                goto exit;
+
+        if (gpt_write_copy(primary, buffer) || fsync(gpt.fd))
+                goto exit;
+
+        gpt.dirty = false;
+        ret = 0;
+
+exit:
+        free(buffer);
+        pthread_mutex_unlock(&gpt.mutex);
+
+        return ret;
+}
@@ -7,6 +7,8 @@
 #ifndef GPT_H
 #define GPT_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define GPT_MAGIC   0x5452415020494645ULL
@@ -49,13 +51,14 @@ struct gpt_entry {
         uint8_t partition_name[PARTNAME_SZ];
 } __attribute__((packed));
 
-struct gpt_partition {
-        uint8_t type_guid[GUID_LEN];
-        uint8_t part_guid[GUID_LEN];
-        uint64_t lba_start;
-        uint64_t lba_end;
-        uint64_t flags;
-        uint16_t name[36];
-};
+int gpt_load(int fd);
+unsigned int gpt_count(void);
+struct gpt_entry *gpt_get_entry(unsigned int index);
+void gpt_entry_name(struct gpt_entry *entry, char *name, size_t size);
+struct gpt_entry *gpt_find(const char *name);
+void gpt_lock(void);
+void gpt_unlock(bool dirty);
+int gpt_flush(void);
+int gpt_replace(const char *data, size_t size);
 
 #endif
@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "part.h"
+#include "tpool.h"
+#include "utils.h"
+
+#define HASH_READERS    4
+#define HASH_SLOTS      8
+#define HASH_CHUNK_SIZE (4 * SZ_1M)
+#define HASH_ALIGN      4096
+
+/*
+ * SHA-256 is sequential, the storage is not: reader threads keep HASH_SLOTS
+ * chunks in flight while the caller hashes them back in order. Reads bypass
+ * the page cache to check what actually landed on the device.
+ */
+struct hash_slot {
+        char *buf;
+        uint64_t offset;
+        size_t size;
+        bool ready;
+        int status;
+        struct hash_ctx *ctx;
+};
+
+struct hash_ctx {
+        int fd;
+        bool direct;
+        struct hash_slot slots[HASH_SLOTS];
+        unsigned int pending;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+};
+
+static struct tpool *hash_readers;
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+
+static void hash_init(void)
+{
+        hash_readers = tpool_create(HASH_READERS);
+}
+
+static int hash_read(struct hash_ctx *ctx, struct hash_slot *slot)
+{
+        size_t count = slot->size;
+        size_t done = 0;
+        ssize_t ret;
+
+        /* direct reads need a block multiple, the device end gives a short read */
+        if (ctx->direct)
+                count = DIV_ROUND_UP(count, HASH_ALIGN) * HASH_ALIGN;
+
+        while (done < slot->size) {
+                ret = pread(ctx->fd, slot->buf + done, count - done, slot->offset + done);
+                if (ret == -1 && errno == EINTR)
+                        continue;
+
+                if (ret == -1) {
+                        log("read at %llu failed: %s\n",
+                            (unsigned long long)(slot->offset + done), strerror(errno));
+                        return -1;
+                }
+
+                if (ret == 0) {
+                        log("read at %llu: unexpected end of device\n",
+                            (unsigned long long)(slot->offset + done));
+                        return -1;
+                }
+
+                done += ret;
+        }
+
+        return 0;
+}
+
+static void hash_read_task(void *arg, unsigned int worker)
+{
+        struct hash_slot *slot = arg;
+        struct hash_ctx *ctx = slot->ctx;
+        int status;
+
+        status = hash_read(ctx, slot);
+
+        pthread_mutex_lock(&ctx->mutex);
+        slot->status = status;
+        slot->ready = true;
+        ctx->pending--;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->mutex);
+}
+
+static void hash_queue(struct hash_ctx *ctx, struct hash_slot *slot, uint64_t offset,
+                       size_t size)
+{
+        slot->offset = offset;
+        slot->size = size;
+        slot->ready = false;
+
+        if (hash_readers) {
+                pthread_mutex_lock(&ctx->mutex);
+                ctx->pending++;
+                pthread_mutex_unlock(&ctx->mutex);
+
+                if (!tpool_queue(hash_readers, hash_read_task, slot))
+                        return;
+
+                pthread_mutex_lock(&ctx->mutex);
+                ctx->pending--;
+                pthread_mutex_unlock(&ctx->mutex);
+        }
+
+        /* no reader threads: read in the caller */
+        slot->status = hash_read(ctx, slot);
+        slot->ready = true;
+}
+
+static int hash_wait(struct hash_ctx *ctx, struct hash_slot *slot)
+{
+        pthread_mutex_lock(&ctx->mutex);
+        while (!slot->ready)
+                pthread_cond_wait(&ctx->cond, &ctx->mutex);
+        pthread_mutex_unlock(&ctx->mutex);
+
+        return slot->status;
+}
+
+static void hash_drain(struct hash_ctx *ctx)
+{
+        pthread_mutex_lock(&ctx->mutex);
+        while (ctx->pending)
+                pthread_cond_wait(&ctx->cond, &ctx->mutex);
+        pthread_mutex_unlock(&ctx->mutex);
+}
+
+int hash_part(struct part_info *info, uint64_t offset, uint64_t size,
+              uint8_t digest[SHA256_DIGEST_SIZE])
+{
+        struct hash_ctx ctx = { 0 };
+        struct sha256_ctx sha;
+        struct hash_slot *slot;
+        uint64_t queued = 0;
+        size_t count;
+        int ret = -1;
+
+        pthread_once(&hash_once, hash_init);
+
+        if (offset > info->size || size > info->size - offset) {
+                log("hash %s out of bounds\n", info->name);
+                return -1;
+        }
+        offset += info->offset;
+
+        ctx.direct = info->direct_fd != -1 && !(offset % HASH_ALIGN);
+        ctx.fd = ctx.direct ? info->direct_fd : info->fd;
+
+        pthread_mutex_init(&ctx.mutex, NULL);
+        pthread_cond_init(&ctx.cond, NULL);
+
+        for (int i = 0; i < HASH_SLOTS; i++) {
+                ctx.slots[i].ctx = &ctx;
+                if (posix_memalign((void **)&ctx.slots[i].buf, HASH_ALIGN, HASH_CHUNK_SIZE)) {
+                        log("cannot allocate hash buffer\n");
+                        goto exit;
+                }
+        }
+
+        sha256_init(&sha);
+
+        for (int i = 0; i < HASH_SLOTS && queued < size; i++) {
+                count = MIN(size - queued, HASH_CHUNK_SIZE);
+                hash_queue(&ctx, &ctx.slots[i], offset + queued, count);
+                queued += count;
+        }
+
+        for (uint64_t chunk = 0; chunk * HASH_CHUNK_SIZE < size; chunk++) {
+                slot = &ctx.slots[chunk % HASH_SLOTS];
+
+                if (hash_wait(&ctx, slot))
+                        goto exit;
+
+                sha256_update(&sha, slot->buf, slot->size);
+
+                if (queued < size) {
+                        count = MIN(size - queued, HASH_CHUNK_SIZE);
+                        hash_queue(&ctx, slot, offset + queued, count);
+                        queued += count;
+                }
+        }
+
+        sha256_final(&sha, digest);
+        ret = 0;
+
+exit:
+        /* buffers can only go once no reader uses them */
+        hash_drain(&ctx);
+
+        for (int i = 0; i < HASH_SLOTS; i++)
+                free(ctx.slots[i].buf);
+
+        pthread_cond_destroy(&ctx.cond);
+        pthread_mutex_destroy(&ctx.mutex);
+
+        return ret;
+}
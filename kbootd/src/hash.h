@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+
+#include "sha256.h"
+
+struct part_info;
+
+int hash_part(struct part_info *info, uint64_t offset, uint64_t size,
+              uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif
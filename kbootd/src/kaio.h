@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#ifndef KAIO_H
+#define KAIO_H
+
+#include <linux/aio_abi.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Linux native AIO syscalls, musl does not provide libaio */
+
+static inline int io_setup(unsigned int nr_events, aio_context_t *ctx)
+{
+        return syscall(__NR_io_setup, nr_events, ctx);
+}
+
+static inline int io_destroy(aio_context_t ctx)
+{
+        return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+        return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static inline int io_cancel(aio_context_t ctx, struct iocb *iocb, struct io_event *result)
+{
+        return syscall(__NR_io_cancel, ctx, iocb, result);
+}
+
+static inline int io_getevents(aio_context_t ctx, long min_nr, long nr,
+                               struct io_event *events, struct timespec *timeout)
+{
+        return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+#endif
@@ -4,102 +4,18 @@
  * Author: Julien Masson <jmasson@baylibre.com>
  */
 
+#include "autoboot.h"
 #include "boot.h"
 #include "fastboot.h"
 #include "fb_command.h"
 #include "part.h"
 #include "utils.h"
 
-#include <sys/select.h>
-#include <termios.h>
-#include <unistd.h>
-
-#define REBOOT_TO_BOOTLOADER BIT(0)
-
 static void start_console(void)
 {
         run_program("console", true);
 }
 
-static bool check_reboot_bootloader_flag(void)
-{
-        uint64_t attr = 0;
-        int ret;
-
-        ret = part_read_attr("bootloaders", &attr);
-        if (ret == -1) {
-                log("cannot read attributes from bootloaders\n");
-                return false;
-        }
-
-        if (attr & REBOOT_TO_BOOTLOADER) {
-                attr &= ~REBOOT_TO_BOOTLOADER;
-                ret = part_write_attr("bootloaders", attr);
-                if (ret == -1)
-                        log("cannot write attributes to bootloaders\n");
-                return true;
-        }
-
-        return false;
-}
-
-static bool prompt_stop_boot(void)
-{
-        struct timeval timeout;
-        fd_set s;
-        int i = 4;
-
-        do {
-                log("Press any key to stop boot ... %i  \r", i);
-                fflush(stdout);
-                FD_ZERO(&s);
-                FD_SET(STDIN_FILENO, &s);
-
-                timeout.tv_sec = 1;
-                timeout.tv_usec = 0;
-
-                select(STDIN_FILENO + 1, &s, NULL, NULL, &timeout);
-                if (FD_ISSET(STDIN_FILENO, &s))
-                        break;
-        } while (i-- > 0);
-
-        return i > 0 ? true : false;
-}
-
-static void set_terminal_single_char_read(void)
-{
-        struct termios local_term_attributes;
-
-        if (!isatty(STDIN_FILENO))
-                return;
-        if (tcgetattr(STDIN_FILENO, &local_term_attributes))
-                return;
-
-        local_term_attributes.c_lflag &= ~(ICANON | ECHO);
-        local_term_attributes.c_cc[VMIN] = 1;
-        local_term_attributes.c_cc[VTIME] = 0;
-        tcsetattr(STDIN_FILENO, TCSANOW, &local_term_attributes);
-}
-
-static bool stop_boot(void)
-{
-        bool stop;
-
-        stop = check_reboot_bootloader_flag();
-        if (stop) {
-                log("reboot bootloader flag detected\n");
-                return stop;
-        }
-
-        set_terminal_single_char_read();
-
-        stop = prompt_stop_boot();
-        if (stop)
-                return stop;
-
-        return false;
-}
-
 int main(void)
 {
         int ret;
@@ -112,10 +28,18 @@ int main(void)
                 return ret;
         }
 
-        if (stop_boot())
+        /* load the boot image while the user can still stop boot */
+        boot_prefetch_start();
+
+        if (autoboot_stop()) {
+                boot_prefetch_cancel();
                 start_console();
-        else
-                return boot_android();
+        } else {
+                ret = boot_prefetch_wait();
+                if (!ret)
+                        boot_exec();
+                return ret;
+        }
 
         ret = fastboot_init();
         if (ret == -1) {
@@ -123,8 +47,17 @@ int main(void)
                 return ret;
         }
 
+        ret = fb_command_init();
+        if (ret == -1) {
+                log("fastboot command init failed\n");
+                return ret;
+        }
+
         fb_command_loop();
 
+        /* continue: jump to the kernel loaded in place, if any */
+        boot_exec();
+
         log("exit\n");
 
         return 0;
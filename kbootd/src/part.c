@@ -4,509 +4,1011 @@
  * Author: Julien Masson <jmasson@baylibre.com>
  */
 
+#define _GNU_SOURCE
 #define _LARGEFILE64_SOURCE
 
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/blkpg.h>
 #include <linux/fs.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "blkio.h"
+#include "decompress.h"
 #include "gpt.h"
 #include "part.h"
 #include "sparse.h"
+#include "tpool.h"
 #include "utils.h"
 
-static struct hsearch_data *partitions_htab;
+#define PART_FILL_BUF_SIZE (256 * SZ_1K)
+#define PART_SHARD_SIZE    (4 * SZ_1M)
+
+/* mmc0, mmc0boot0 and mmc0boot1 are added next to the GPT partitions */
+#define PART_DEVICES 3
+
+/* superblock magics, little endian */
+#define EXT4_MAGIC_OFFSET 1080
+#define EXT4_MAGIC        0xef53
+#define F2FS_MAGIC_OFFSET 1024
+#define F2FS_MAGIC        0xf2f52010
+
+static struct part_info *part_infos;
+static unsigned int part_infos_len;
+
+/* the same entries sorted by path, for the part_* calls given a path */
+static struct part_info **part_paths;
+
+/* whole disk handles, shared by the GPT partitions, the GPT and BLKPG updates */
+static int part_disk_fd = -1;
+static int part_disk_direct_fd = -1;
 
-static int mbr_valid(const char *mbr)
+/* sparse chunk writers, NULL to write sparse images from the flash thread */
+static struct tpool *part_writers;
+
+/* discard the regions skipped by sparse DONT_CARE chunks (oem dont-care) */
+static bool part_discard_dont_care;
+
+/* skip the blocks already holding the data being flashed (oem delta) */
+static bool part_delta;
+
+/* buffered handle, read-write when possible, and O_DIRECT one (-1 if not supported) */
+static int part_open_device(const char *path, int *fd, int *direct_fd)
 {
-        return (mbr[510] == 0x55 && mbr[511] == 0xaa);
+        *fd = open(path, O_RDWR);
+        if (*fd == -1)
+                *fd = open(path, O_RDONLY);
+        if (*fd == -1) {
+                log("open %s failed: %s\n", path, strerror(errno));
+                return -1;
+        }
+
+        *direct_fd = open(path, O_RDWR | O_DIRECT);
+
+        return 0;
 }
 
-static void gpt_get_name(uint16_t *s, char *name)
+/*
+ * GPT partitions are windows of the whole disk: they share its handles and
+ * are addressed by their LBA range, their device nodes are never used. The
+ * boot partitions are separate devices and get their own handles.
+ */
+static int part_info_open(struct part_info *info, const char *path,
+                          struct gpt_entry *part)
 {
-        char buf[37];
-        int i = 0;
-        while (i < ARRAY_SIZE(buf) - 1) {
-                if (s[i] == 0)
-                        break;
-                buf[i] = (0x20 <= s[i] && s[i] < 0x7f) ? s[i] : '?';
-                i++;
+        snprintf(info->path, sizeof(info->path), "%s", path);
+
+        if (part) {
+                gpt_entry_name(part, info->name, sizeof(info->name));
+                info->lba_start = part->starting_lba;
+                info->lba_end = part->ending_lba;
+                memcpy(&info->attributes, &part->attributes, sizeof(info->attributes));
+                memcpy(info->type_guid, part->partition_type_guid, GUID_LEN);
+                memcpy(info->part_guid, part->unique_partition_guid, GUID_LEN);
+        }
+
+        if (part || !strcmp(path, MMC_BLK)) {
+                info->fd = part_disk_fd;
+                info->direct_fd = part_disk_direct_fd;
+        } else if (part_open_device(path, &info->fd, &info->direct_fd)) {
+                return -1;
+        }
+
+        if (ioctl(info->fd, BLKSSZGET, &info->block_size))
+                info->block_size = LBA_SIZE;
+        if (ioctl(info->fd, BLKIOOPT, &info->io_opt))
+                info->io_opt = 0;
+
+        if (part) {
+                info->offset = info->lba_start * LBA_SIZE;
+                info->size = (info->lba_end - info->lba_start + 1) * LBA_SIZE;
+                return 0;
+        }
+
+        /* whole devices, the range is the device itself */
+        if (ioctl(info->fd, BLKGETSIZE64, &info->size))
+                info->size = 0;
+        if (info->size)
+                info->lba_end = info->size / LBA_SIZE - 1;
+
+        return 0;
+}
+
+static void part_info_add(const char *name, const char *path, struct gpt_entry *part)
+{
+        struct part_info *info = &part_infos[part_infos_len];
+
+        if (name)
+                snprintf(info->name, sizeof(info->name), "%s", name);
+
+        if (part_info_open(info, path, part)) {
+                memset(info, 0, sizeof(struct part_info));
+                return;
         }
-        buf[i] = '\0';
-        memcpy(name, buf, ARRAY_SIZE(buf));
+
+        part_infos_len++;
 }
 
-static void part_fill_hashmap(struct gpt_partition *partitions, int partitions_nbr)
+static int part_info_cmp(const void *a, const void *b)
 {
-        struct gpt_partition *part;
-        char *name, *path;
+        const struct part_info *pa = a, *pb = b;
 
-        partitions_htab = malloc(sizeof(struct hsearch_data));
-        memset(partitions_htab, 0, sizeof(struct hsearch_data));
-        hcreate_r(partitions_nbr, partitions_htab);
+        return strcmp(pa->name, pb->name);
+}
 
-        hashmap_add(partitions_htab, "mmc0", MMC_BLK);
-        hashmap_add(partitions_htab, "mmc0boot0", MMC_BLK_BOOT0);
-        hashmap_add(partitions_htab, "mmc0boot1", MMC_BLK_BOOT1);
+static int part_name_cmp(const void *key, const void *elem)
+{
+        const struct part_info *info = elem;
 
-        for (int i = 0; i < partitions_nbr; i++) {
-                part = partitions + i;
-                if (part->lba_start) {
-                        name = malloc(256 * sizeof(char));
-                        gpt_get_name(part->name, name);
+        return strcmp(key, info->name);
+}
 
-                        path = malloc(256 * sizeof(char));
-                        snprintf(path, 256, "%sp%d", MMC_BLK, i + 1);
+static int part_path_sort_cmp(const void *a, const void *b)
+{
+        const struct part_info *const *pa = a, *const *pb = b;
 
-                        hashmap_add(partitions_htab, name, path);
+        return strcmp((*pa)->path, (*pb)->path);
+}
+
+static int part_path_cmp(const void *key, const void *elem)
+{
+        const struct part_info *const *info = elem;
+
+        return strcmp(key, (*info)->path);
+}
+
+/*
+ * Partition table: one contiguous array sorted by name, looked up with a
+ * binary search. The whole devices are listed next to the GPT partitions.
+ */
+static int part_fill_table(void)
+{
+        struct gpt_entry *part;
+        char path[PART_PATH_SIZE];
+
+        part_infos = calloc(gpt_count() + PART_DEVICES, sizeof(struct part_info));
+        if (!part_infos) {
+                log("cannot allocate partition table\n");
+                return -1;
+        }
+
+        part_info_add("mmc0", MMC_BLK, NULL);
+        part_info_add("mmc0boot0", MMC_BLK_BOOT0, NULL);
+        part_info_add("mmc0boot1", MMC_BLK_BOOT1, NULL);
+
+        for (unsigned int i = 0; i < gpt_count(); i++) {
+                part = gpt_get_entry(i);
+                if (part->starting_lba) {
+                        snprintf(path, sizeof(path), "%sp%u", MMC_BLK, i + 1);
+                        part_info_add(NULL, path, part);
                 }
         }
+
+        qsort(part_infos, part_infos_len, sizeof(struct part_info), part_info_cmp);
+
+        part_paths = calloc(part_infos_len, sizeof(struct part_info *));
+        if (!part_paths) {
+                log("cannot allocate partition table\n");
+                return -1;
+        }
+
+        for (unsigned int i = 0; i < part_infos_len; i++)
+                part_paths[i] = &part_infos[i];
+        qsort(part_paths, part_infos_len, sizeof(struct part_info *), part_path_sort_cmp);
+
+        return 0;
+}
+
+static void part_close_table(void)
+{
+        struct part_info *info;
+
+        for (unsigned int i = 0; i < part_infos_len; i++) {
+                info = &part_infos[i];
+                if (info->fd == part_disk_fd)
+                        continue;
+
+                close(info->fd);
+                if (info->direct_fd != -1)
+                        close(info->direct_fd);
+        }
+
+        free(part_paths);
+        part_paths = NULL;
+        free(part_infos);
+        part_infos = NULL;
+        part_infos_len = 0;
+}
+
+struct part_info *part_get_by_name(const char *name)
+{
+        return bsearch(name, part_infos, part_infos_len, sizeof(struct part_info),
+                       part_name_cmp);
 }
 
 char *part_get_path(char *name)
 {
-        return hashmap_get(partitions_htab, name);
+        struct part_info *info = part_get_by_name(name);
+
+        return info ? info->path : NULL;
 }
 
-uint64_t part_get_size(char *path)
+struct part_info *part_get_info(const char *path)
 {
-        uint64_t size;
-        int fd;
+        struct part_info **info = NULL;
 
-        fd = open(path, O_RDONLY);
-        if (fd == -1) {
-                log("open %s failed: %s\n", path, strerror(errno));
-                return 0;
-        }
+        if (part_paths)
+                info = bsearch(path, part_paths, part_infos_len, sizeof(struct part_info *),
+                               part_path_cmp);
+        if (info)
+                return *info;
+
+        log("unknown partition %s\n", path);
 
-        ioctl(fd, BLKGETSIZE64, &size);
+        return NULL;
+}
+
+unsigned int part_count(void)
+{
+        return part_infos_len;
+}
+
+struct part_info *part_get_index(unsigned int index)
+{
+        return index < part_infos_len ? &part_infos[index] : NULL;
+}
+
+/* filesystem found on the partition, as reported to fastboot (partition-type) */
+const char *part_get_type(struct part_info *info)
+{
+        uint32_t f2fs_magic;
+        uint16_t ext4_magic;
+
+        if (pread(info->fd, &ext4_magic, sizeof(ext4_magic),
+                  info->offset + EXT4_MAGIC_OFFSET) ==
+                    sizeof(ext4_magic) &&
+            ext4_magic == EXT4_MAGIC)
+                return "ext4";
+
+        if (pread(info->fd, &f2fs_magic, sizeof(f2fs_magic),
+                  info->offset + F2FS_MAGIC_OFFSET) ==
+                    sizeof(f2fs_magic) &&
+            f2fs_magic == F2FS_MAGIC)
+                return "f2fs";
+
+        return "raw";
+}
 
-        close(fd);
+uint64_t part_get_size(char *path)
+{
+        struct part_info *info = part_get_info(path);
 
-        return size;
+        return info ? info->size : 0;
 }
 
 int part_read(char *path, void *buffer, size_t offset, size_t size)
 {
-        int fd, ret;
+        struct part_info *info = part_get_info(path);
+        char *data = buffer;
+        ssize_t count;
 
-        fd = open(path, O_RDONLY);
-        if (fd == -1) {
-                log("open %s failed: %s\n", path, strerror(errno));
+        if (!info)
+                return -1;
+
+        if (offset > info->size || size > info->size - offset) {
+                log("read part %s out of bounds\n", path);
                 return -1;
         }
+        offset += info->offset;
 
-        ret = lseek(fd, offset, SEEK_SET);
-        if (ret == -1) {
-                log("lseek part read failed: %s\n", strerror(errno));
-                goto exit;
+        while (size) {
+                count = pread(info->fd, data, size, offset);
+                if (count == -1 && errno == EINTR)
+                        continue;
+
+                if (count <= 0) {
+                        log("read part %s failed\n", path);
+                        return -1;
+                }
+
+                data += count;
+                offset += count;
+                size -= count;
         }
 
-        ret = kread_full(fd, buffer, size, 4096);
-        if (ret == -1)
-                log("read part %s failed\n", path);
+        return 0;
+}
 
-exit:
-        close(fd);
-        return ret;
+/*
+ * A lane is a block writer with its own fill pattern. Raw images and inline
+ * sparse images use the stream lane, parallel sparse images give one lane to
+ * each writer thread, opened on first use.
+ */
+struct part_lane {
+        struct blkio *bio;
+        uint32_t *fill_buf;
+        uint32_t fill_value;
+        bool fill_valid;
+};
+
+struct part_stream {
+        struct part_info *info;
+        struct part_lane lane;
+        uint64_t size;
+        uint64_t start;
+        uint64_t offset;
+        bool started;
+        bool probed;
+        bool sparse;
+        struct decomp *decomp;
+        struct sparse_decoder decoder;
+        struct part_lane *writers;
+        atomic_bool writers_error;
+};
+
+enum part_op_type {
+        PART_OP_WRITE,
+        PART_OP_FILL,
+        PART_OP_DISCARD,
+};
+
+/* sparse chunk work handed to a writer thread */
+struct part_op {
+        struct part_stream *stream;
+        enum part_op_type type;
+        uint64_t offset;
+        void *data;
+        uint32_t value;
+        uint64_t size;
+};
+
+void part_set_discard_dont_care(bool enable)
+{
+        part_discard_dont_care = enable;
+}
+
+void part_set_delta(bool enable)
+{
+        part_delta = enable;
+}
+
+static unsigned int part_blkio_flags(void)
+{
+        return part_delta ? BLKIO_DELTA : 0;
+}
+
+static struct blkio *part_blkio_open(struct part_info *info)
+{
+        struct blkio_window window = {
+                .name = info->path,
+                .fd = info->direct_fd,
+                .buffered_fd = info->fd,
+                .base = info->offset,
+                .size = info->size,
+        };
+
+        return blkio_open(&window, part_blkio_flags());
+}
+
+static void part_fill_pattern(uint32_t *buf, uint32_t value, size_t size)
+{
+        size_t count = size / sizeof(uint32_t);
+        size_t i = 0;
+
+#ifdef __ARM_NEON
+        uint32x4_t tile = vdupq_n_u32(value);
+
+        for (; i + 16 <= count; i += 16) {
+                vst1q_u32(buf + i, tile);
+                vst1q_u32(buf + i + 4, tile);
+                vst1q_u32(buf + i + 8, tile);
+                vst1q_u32(buf + i + 12, tile);
+        }
+#endif
+
+        for (; i < count; i++)
+                buf[i] = value;
 }
 
-static int part_write_sparse(int fd, void *data, uint64_t part_size)
+static int part_lane_write(struct part_lane *lane, uint64_t offset, void *data,
+                           size_t size)
 {
-        struct sparse_header *sparse_header = (struct sparse_header *)data;
-        struct chunk_header *chunk_header;
-        uint64_t chunk, chunk_data_sz, fill_size, offset = 0;
-        uint32_t *fill_buf, fill_val;
         int ret;
 
-        data += sizeof(struct sparse_header);
+        ret = blkio_write(lane->bio, offset, data, size);
+        if (ret == -1)
+                log("write RAW chunk failed\n");
 
-        for (chunk = 0; chunk < sparse_header->total_chunks; chunk++) {
-                chunk_header = (struct chunk_header *)data;
+        return ret;
+}
 
-                data += CHUNK_HEADER_LEN;
-                if (sparse_header->chunk_hdr_sz > CHUNK_HEADER_LEN) {
-                        /* Skip the remaining bytes in a header that is longer than
-			 * we expected.
-			 */
-                        data += (sparse_header->chunk_hdr_sz - CHUNK_HEADER_LEN);
+static int part_lane_fill(struct part_lane *lane, uint64_t offset, uint32_t value,
+                          uint64_t size)
+{
+        uint64_t count;
+
+        /* zero fills are mostly free with write-zeroes or unmap */
+        if (!value && !blkio_zeroout(lane->bio, offset, size))
+                return 0;
+
+        if (!lane->fill_buf) {
+                if (posix_memalign((void **)&lane->fill_buf, 4096, PART_FILL_BUF_SIZE)) {
+                        log("malloc failed for: CHUNK_TYPE_FILL\n");
+                        return -1;
                 }
+                lane->fill_valid = false;
+        }
 
-                chunk_data_sz = chunk_header->total_sz - sparse_header->chunk_hdr_sz;
+        if (!lane->fill_valid || lane->fill_value != value) {
+                /* queued writes may still read the previous pattern */
+                if (blkio_flush(lane->bio))
+                        return -1;
 
-                switch (chunk_header->chunk_type) {
-                case CHUNK_TYPE_RAW:
-                        if ((offset + chunk_data_sz) > part_size) {
-                                log("request would exceed partition size\n");
-                                return -1;
-                        }
+                part_fill_pattern(lane->fill_buf, value, PART_FILL_BUF_SIZE);
+                lane->fill_value = value;
+                lane->fill_valid = true;
+        }
 
-                        ret = kwrite(fd, data, chunk_data_sz);
-                        if (ret == -1) {
-                                log("write RAW chunk failed\n");
-                                return -1;
-                        }
+        while (size) {
+                count = MIN(size, PART_FILL_BUF_SIZE);
 
-                        data += chunk_data_sz;
-                        break;
+                if (blkio_write(lane->bio, offset, lane->fill_buf, count)) {
+                        log("write FILL chunk failed\n");
+                        return -1;
+                }
 
-                case CHUNK_TYPE_FILL:
-                        if (chunk_data_sz != sizeof(uint32_t)) {
-                                log("bogus chunk size for chunk type FILL");
-                                return -1;
-                        }
+                offset += count;
+                size -= count;
+        }
 
-                        fill_size = chunk_header->chunk_sz * sparse_header->blk_sz;
+        return 0;
+}
 
-                        if ((offset + fill_size) > part_size) {
-                                log("request would exceed partition size\n");
-                                return -1;
-                        }
+static int part_lane_discard(struct part_lane *lane, uint64_t offset, uint64_t size)
+{
+        /* best effort: the content of DONT_CARE regions is undefined anyway */
+        if (blkio_discard(lane->bio, offset, size))
+                log("discard DONT_CARE chunk failed: %s\n", strerror(errno));
 
-                        fill_val = *(uint32_t *)data;
+        return 0;
+}
 
-                        fill_buf = malloc(fill_size);
-                        if (!fill_buf) {
-                                log("malloc failed for: CHUNK_TYPE_FILL\n");
-                                return -1;
-                        }
+static int part_lane_flush(struct part_lane *lane)
+{
+        return lane->bio ? blkio_flush(lane->bio) : 0;
+}
 
-                        uint32_t *tmp_buf;
-                        tmp_buf = (uint32_t *)fill_buf;
-                        for (uint32_t i = 0; i < (fill_size / sizeof(fill_val)); i++)
-                                tmp_buf[i] = fill_val;
+static int part_lane_close(struct part_lane *lane)
+{
+        int ret = 0;
 
-                        ret = kwrite(fd, (char *)fill_buf, fill_size);
-                        free(fill_buf);
-                        if (ret == -1) {
-                                log("write FILL chunk failed\n");
-                                return -1;
-                        }
+        if (lane->bio)
+                ret = blkio_close(lane->bio);
+        free(lane->fill_buf);
 
-                        data += sizeof(uint32_t);
-                        break;
+        return ret;
+}
 
-                case CHUNK_TYPE_DONT_CARE:
-                        uint64_t len = chunk_header->chunk_sz * sparse_header->blk_sz;
-                        ret = lseek64(fd, len, SEEK_CUR);
-                        if (ret == -1) {
-                                log("lseek chunk DONT_CARE failed: %s\n",
-                                    strerror(errno));
-                                return -1;
-                        }
+static void part_op_run(void *arg, unsigned int worker)
+{
+        struct part_op *op = arg;
+        struct part_stream *stream = op->stream;
+        struct part_lane *lane = &stream->writers[worker];
+        int ret = -1;
+
+        if (!lane->bio)
+                lane->bio = part_blkio_open(stream->info);
+
+        if (lane->bio) {
+                switch (op->type) {
+                case PART_OP_WRITE:
+                        ret = part_lane_write(lane, op->offset, op->data, op->size);
                         break;
-
-                case CHUNK_TYPE_CRC32:
-                        log("chunk type CRC32 not supported\n");
-                        data += sizeof(uint32_t);
+                case PART_OP_FILL:
+                        ret = part_lane_fill(lane, op->offset, op->value, op->size);
+                        break;
+                case PART_OP_DISCARD:
+                        ret = part_lane_discard(lane, op->offset, op->size);
                         break;
+                }
+        }
+
+        if (ret)
+                atomic_store(&stream->writers_error, true);
 
-                default:
-                        log("unknown chunk type: %x\n", chunk_header->chunk_type);
+        free(op);
+}
+
+/*
+ * Split the op on PART_SHARD_SIZE boundaries so that one large chunk keeps
+ * several writers busy. Shards are aligned on the partition offset, writers
+ * never share a block.
+ */
+static int part_queue_op(struct part_stream *stream, enum part_op_type type,
+                         uint64_t offset, void *data, uint32_t value, uint64_t size)
+{
+        struct part_op *op;
+        uint64_t count;
+
+        while (size) {
+                count = MIN(size, PART_SHARD_SIZE - offset % PART_SHARD_SIZE);
+
+                op = malloc(sizeof(struct part_op));
+                if (!op) {
+                        log("malloc failed: %s\n", strerror(errno));
+                        return -1;
+                }
+
+                *op = (struct part_op){
+                        .stream = stream,
+                        .type = type,
+                        .offset = offset,
+                        .data = data,
+                        .value = value,
+                        .size = count,
+                };
+
+                if (tpool_queue(part_writers, part_op_run, op)) {
+                        free(op);
                         return -1;
                 }
+
+                offset += count;
+                if (data)
+                        data = (char *)data + count;
+                size -= count;
         }
 
         return 0;
 }
 
-static bool sparse_image(void *data)
+static int part_sparse_write(void *priv, uint64_t offset, void *data, size_t size)
 {
-        struct sparse_header *sparse_header = (struct sparse_header *)data;
+        struct part_stream *stream = priv;
 
-        if ((sparse_header->magic == SPARSE_HEADER_MAGIC) &&
-            (sparse_header->major_version) == 1)
-                return true;
+        if (stream->writers)
+                return part_queue_op(stream, PART_OP_WRITE, offset, data, 0, size);
 
-        return false;
+        return part_lane_write(&stream->lane, offset, data, size);
 }
 
-static int part_write_raw(int fd, void *data, uint64_t *offset, size_t size)
+static int part_sparse_fill(void *priv, uint64_t offset, uint32_t value, uint64_t size)
 {
-        int ret;
+        struct part_stream *stream = priv;
 
-        ret = lseek(fd, *offset, SEEK_SET);
-        if (ret == -1) {
-                log("lseek part write failed: %s\n", strerror(errno));
-                return -1;
-        }
+        if (stream->writers)
+                return part_queue_op(stream, PART_OP_FILL, offset, NULL, value, size);
+
+        return part_lane_fill(&stream->lane, offset, value, size);
+}
+
+static int part_sparse_skip(void *priv, uint64_t offset, uint64_t size)
+{
+        struct part_stream *stream = priv;
+
+        if (!part_discard_dont_care)
+                return 0;
+
+        if (stream->writers)
+                return part_queue_op(stream, PART_OP_DISCARD, offset, NULL, 0, size);
+
+        return part_lane_discard(&stream->lane, offset, size);
+}
+
+static const struct sparse_ops part_sparse_ops = {
+        .write = part_sparse_write,
+        .fill = part_sparse_fill,
+        .skip = part_sparse_skip,
+};
+
+static int part_write_raw(struct part_stream *stream, void *data, size_t size)
+{
+        int ret;
 
-        ret = kwrite(fd, data, size);
+        ret = blkio_write(stream->lane.bio, stream->offset, data, size);
         if (ret == -1) {
                 log("write to RAW partition failed\n");
                 return -1;
         }
 
-        *offset += size;
+        stream->offset += size;
 
         return 0;
 }
 
-int part_flash(char *path, void *data, uint64_t *offset, size_t size)
+/* wait for the queued sparse work, the caller releases data once we return */
+static int part_stream_sync(struct part_stream *stream)
 {
-        uint64_t part_size;
-        int fd, ret;
+        int ret = 0;
 
-        fd = open(path, O_WRONLY);
-        if (fd == -1) {
-                log("open %s failed: %s\n", path, strerror(errno));
-                return -1;
-        }
+        if (part_lane_flush(&stream->lane))
+                ret = -1;
 
-        if (sparse_image(data)) {
-                part_size = part_get_size(path);
-                ret = part_write_sparse(fd, data, part_size);
-        } else {
-                ret = part_write_raw(fd, data, offset, size);
+        if (!stream->writers)
+                return ret;
+
+        tpool_wait(part_writers);
+
+        for (unsigned int i = 0; i < tpool_threads(part_writers); i++) {
+                if (part_lane_flush(&stream->writers[i]))
+                        ret = -1;
         }
 
-        close(fd);
+        if (atomic_exchange(&stream->writers_error, false))
+                ret = -1;
+
         return ret;
 }
 
-int part_erase(char *path, size_t len)
+struct part_stream *part_stream_open(struct part_info *info, uint64_t offset)
 {
-        char buf[4096] = { 0 };
-        uint64_t range[2];
-        int ret, fd;
+        struct part_stream *stream;
 
-        fd = open(path, O_WRONLY);
-        if (fd == -1) {
-                log("open %s failed: %s\n", path, strerror(errno));
-                return -1;
+        stream = calloc(1, sizeof(struct part_stream));
+        if (!stream) {
+                log("malloc failed: %s\n", strerror(errno));
+                return NULL;
         }
 
-        /* First attempt with BLKSECDISCARD */
-        range[0] = 0;
-        range[1] = len;
+        stream->lane.bio = part_blkio_open(info);
+        if (!stream->lane.bio) {
+                free(stream);
+                return NULL;
+        }
 
-        ret = ioctl(fd, BLKSECDISCARD, &range);
-        if (!ret)
-                goto exit;
+        stream->info = info;
+        stream->start = offset;
+        stream->offset = offset;
 
-        /* Second attempt with BLKDISCARD */
-        range[0] = 0;
-        range[1] = len;
+        return stream;
+}
 
-        ret = ioctl(fd, BLKDISCARD, &range);
-        if (!ret)
-                goto exit;
+/* Plain image data, the first bytes decide between a sparse or a raw image */
+static int part_stream_image(void *priv, void *data, size_t size)
+{
+        struct part_stream *stream = priv;
+        int ret;
 
-        /* Thirst attempt write zeros */
-        ret = kwrite(fd, buf, 4096);
-        if (ret == -1) {
-                log("write zeros failed\n");
-                goto exit;
+        if (!stream->probed) {
+                stream->probed = true;
+
+                if (size >= sizeof(struct sparse_header) && sparse_image(data)) {
+                        stream->sparse = true;
+                        stream->size = stream->info->size;
+                        sparse_decoder_init(&stream->decoder, &part_sparse_ops, stream,
+                                            stream->size);
+
+                        /* chunk offsets are known up front, any order will do */
+                        if (part_writers)
+                                stream->writers = calloc(tpool_threads(part_writers),
+                                                         sizeof(struct part_lane));
+                }
         }
 
-        fsync(fd);
+        if (stream->sparse)
+                ret = sparse_decoder_feed(&stream->decoder, data, size);
+        else
+                ret = part_write_raw(stream, data, size);
+
+        if (part_stream_sync(stream))
+                ret = -1;
 
-exit:
-        close(fd);
         return ret;
 }
 
-static void gpt_convert_efi_name_to_char(char *s, void *es, int n)
+int part_stream_write(struct part_stream *stream, void *data, size_t size)
 {
-        char *ess = es;
-        int i, j;
+        enum decomp_type type;
 
-        memset(s, '\0', n);
+        /* The first fragment tells whether the image is compressed */
+        if (!stream->started) {
+                stream->started = true;
 
-        for (i = 0, j = 0; j <= n; i += 2, j++) {
-                s[j] = ess[i];
-                if (!ess[i])
-                        return;
+                type = decomp_detect(data, size);
+                if (type != DECOMP_NONE) {
+                        stream->decomp = decomp_open(type, part_stream_image, stream);
+                        if (!stream->decomp)
+                                return -1;
+                }
         }
+
+        if (stream->decomp)
+                return decomp_feed(stream->decomp, data, size);
+
+        return part_stream_image(stream, data, size);
 }
 
-static int find_gpt_entry(int fd, const char *name, struct gpt_entry *gpt_e,
-                          off_t *offset)
+/* Output range written so far: from 0 for sparse images */
+void part_stream_extent(struct part_stream *stream, uint64_t *start, uint64_t *end)
 {
-        struct gpt_header *gpt_hdr;
-        char part[PARTNAME_SZ];
-        char data[LBA_SIZE];
-        int ret;
-
-        /* GPT header on LBA 1 */
-        ret = lseek(fd, LBA_SIZE * 1, SEEK_SET);
-        if (ret == -1) {
-                log("lseek LBA 1 failed: %s\n", strerror(errno));
-                return ret;
+        if (stream->sparse) {
+                *start = 0;
+                *end = stream->decoder.offset;
+        } else {
+                *start = stream->start;
+                *end = stream->offset;
         }
+}
 
-        memset(data, '\0', LBA_SIZE);
-        ret = kread(fd, data, LBA_SIZE);
-        if (ret == -1) {
-                log("read GPT header failed\n");
-                return -1;
+bool part_stream_compressed(struct part_stream *stream)
+{
+        return stream->decomp != NULL;
+}
+
+int part_stream_close(struct part_stream *stream, uint64_t *offset)
+{
+        int ret = 0;
+
+        if (stream->decomp && decomp_close(stream->decomp))
+                ret = -1;
+
+        if (stream->sparse && !sparse_decoder_done(&stream->decoder)) {
+                log("sparse image truncated\n");
+                ret = -1;
         }
-        gpt_hdr = (struct gpt_header *)data;
 
-        for (int i = 0; i < gpt_hdr->n_parts; i++) {
-                memset(data, '\0', LBA_SIZE);
-                ret = kread(fd, data, LBA_SIZE);
-                if (ret == -1) {
-                        log("read GPT entry failed\n");
-                        return -1;
-                }
-                memcpy(gpt_e, data, sizeof(struct gpt_entry));
+        if (offset)
+                *offset = stream->offset;
 
-                gpt_convert_efi_name_to_char(part, gpt_e->partition_name, PARTNAME_SZ);
-                if (!strcmp(part, name)) {
-                        *offset = (i + 2) * LBA_SIZE;
-                        return 0;
+        if (stream->writers) {
+                for (unsigned int i = 0; i < tpool_threads(part_writers); i++) {
+                        if (part_lane_close(&stream->writers[i]))
+                                ret = -1;
                 }
+                free(stream->writers);
         }
 
-        return -1;
+        if (part_lane_close(&stream->lane))
+                ret = -1;
+        free(stream);
+
+        return ret;
 }
 
-int part_read_attr(char *name, uint64_t *attr)
+int part_flash(char *path, void *data, uint64_t *offset, size_t size)
 {
-        struct gpt_entry gpt_e;
-        off_t offset;
-        int fd, ret = 0;
+        struct part_info *info = part_get_info(path);
+        struct part_stream *stream;
+        int ret;
 
-        fd = open(MMC_BLK, O_RDONLY);
-        if (fd == -1) {
-                log("open %s failed: %s\n", MMC_BLK, strerror(errno));
+        if (!info)
                 return -1;
-        }
 
-        ret = find_gpt_entry(fd, name, &gpt_e, &offset);
-        if (ret == -1) {
-                log("find GPT entry failed\n");
-                goto exit;
-        }
+        stream = part_stream_open(info, *offset);
+        if (!stream)
+                return -1;
 
-        *attr = gpt_e.attributes.type_guid_specific;
+        ret = part_stream_write(stream, data, size);
+
+        if (part_stream_close(stream, offset))
+                ret = -1;
 
-exit:
-        close(fd);
         return ret;
 }
 
-int part_write_attr(char *name, uint64_t attr)
+/* GPT attributes come from the in-memory GPT, only writes reach the disk */
+int part_read_attr(char *name, uint64_t *attr)
 {
-        struct gpt_entry gpt_e;
-        off_t offset;
-        int fd, ret;
+        struct gpt_entry *entry;
+
+        gpt_lock();
+
+        entry = gpt_find(name);
+        if (entry)
+                *attr = entry->attributes.type_guid_specific;
 
-        fd = open(MMC_BLK, O_RDWR);
-        if (fd == -1) {
-                log("open %s failed: %s\n", MMC_BLK, strerror(errno));
+        gpt_unlock(false);
+
+        if (!entry) {
+                log("find GPT entry failed\n");
                 return -1;
         }
 
-        ret = find_gpt_entry(fd, name, &gpt_e, &offset);
-        if (ret == -1) {
+        return 0;
+}
+
+int part_write_attr(char *name, uint64_t attr)
+{
+        struct gpt_entry *entry;
+
+        gpt_lock();
+
+        entry = gpt_find(name);
+        if (entry)
+                entry->attributes.type_guid_specific = attr;
+
+        gpt_unlock(entry != NULL);
+
+        if (!entry) {
                 log("find GPT entry failed\n");
-                goto exit;
+                return -1;
         }
 
-        gpt_e.attributes.type_guid_specific = attr;
+        return gpt_flush();
+}
 
-        ret = lseek(fd, offset, SEEK_SET);
-        if (ret == -1) {
-                log("lseek part write attr failed: %s\n", strerror(errno));
-                goto exit;
+static int part_blkpg(int op, unsigned int pno, uint64_t start, uint64_t end)
+{
+        struct blkpg_partition part = {
+                .start = start * LBA_SIZE,
+                .length = (end - start + 1) * LBA_SIZE,
+                .pno = pno,
+        };
+        struct blkpg_ioctl_arg arg = {
+                .op = op,
+                .datalen = sizeof(part),
+                .data = &part,
+        };
+
+        if (ioctl(part_disk_fd, BLKPG, &arg)) {
+                log("update of partition %u failed: %s\n", pno, strerror(errno));
+                return -1;
         }
 
-        ret = kwrite(fd, (char *)&gpt_e, sizeof(struct gpt_entry));
-        if (ret == -1)
-                log("write GPT entry failed\n");
+        return 0;
+}
+
+enum { PART_DEL, PART_SHRINK, PART_GROW, PART_ADD };
+
+/*
+ * Apply the GPT changes to the kernel partitions: removed and moved ones are
+ * deleted first, then the resized ones are shrunk before the others grow,
+ * and the new ones are added last so that no two partitions ever overlap.
+ */
+
+static int part_update_kernel(struct gpt_entry *old, unsigned int old_count)
+{
+        unsigned int count = MAX(old_count, gpt_count());
+        uint64_t old_start, old_end, start, end;
+        struct gpt_entry *entry;
+        int ret = 0;
+
+        for (int pass = PART_DEL; pass <= PART_ADD; pass++) {
+                for (unsigned int i = 0; i < count; i++) {
+                        old_start = i < old_count ? old[i].starting_lba : 0;
+                        old_end = i < old_count ? old[i].ending_lba : 0;
+                        entry = gpt_get_entry(i);
+                        start = entry ? entry->starting_lba : 0;
+                        end = entry ? entry->ending_lba : 0;
+
+                        if (old_start == start && old_end == end)
+                                continue;
+
+                        if (old_start != start) {
+                                if (pass == PART_DEL && old_start &&
+                                    part_blkpg(BLKPG_DEL_PARTITION, i + 1, 0, 0))
+                                        ret = -1;
+                                if (pass == PART_ADD && start &&
+                                    part_blkpg(BLKPG_ADD_PARTITION, i + 1, start, end))
+                                        ret = -1;
+                        } else if (start && pass == (end < old_end ? PART_SHRINK : PART_GROW)) {
+                                if (part_blkpg(BLKPG_RESIZE_PARTITION, i + 1, start, end))
+                                        ret = -1;
+                        }
+                }
+        }
 
-exit:
-        close(fd);
         return ret;
 }
 
-int part_init(void)
+/* copy of the GPT entries before a change, to update the kernel partitions */
+static struct gpt_entry *part_save_gpt(unsigned int *count)
 {
-        char mbr[LBA_SIZE];
-        struct gpt_header gpt_hdr;
-        struct gpt_partition *partitions;
-        uint64_t partitions_size;
-        int fd, ret;
+        struct gpt_entry *old;
 
-        if (!file_exist(MMC_BLK)) {
-                if (wait_file_created(MMC_BLK)) {
-                        log("cannot get mmc node\n");
-                        return -1;
-                }
-        }
+        *count = gpt_count();
 
-        fd = open(MMC_BLK, O_RDONLY);
-        if (fd == -1) {
-                log("open %s failed: %s\n", MMC_BLK, strerror(errno));
-                return -1;
-        }
+        old = malloc(MAX(*count, 1) * sizeof(struct gpt_entry));
+        if (!old)
+                return NULL;
 
-        ret = kread(fd, mbr, LBA_SIZE);
-        if (ret == -1) {
-                log("read MBR failed\n");
-                goto exit;
-        }
+        for (unsigned int i = 0; i < *count; i++)
+                old[i] = *gpt_get_entry(i);
 
-        if (!mbr_valid(mbr)) {
-                log("invalid MBR\n");
-                ret = -1;
-                goto exit;
-        }
+        return old;
+}
 
-        /* GPT header on LBA 1 */
-        ret = lseek(fd, LBA_SIZE * 1, SEEK_SET);
-        if (ret == -1) {
-                log("lseek LBA 1 failed: %s\n", strerror(errno));
-                goto exit;
-        }
+/* follow the new GPT: update the kernel partitions and rebuild the table */
+static int part_apply_gpt(struct gpt_entry *old, unsigned int old_count)
+{
+        int ret;
 
-        ret = kread(fd, (char *)&gpt_hdr, LBA_SIZE);
-        if (ret == -1) {
-                log("read GPT header failed\n");
-                goto exit;
-        }
+        /* partitions are disk windows, their nodes are not opened by kbootd */
+        ret = part_update_kernel(old, old_count);
+        free(old);
 
-        if (gpt_hdr.magic != GPT_MAGIC) {
-                log("invalid GPT header\n");
+        part_close_table();
+        if (part_fill_table())
                 ret = -1;
-                goto exit;
-        }
 
-        /* TODO: check crc32 */
+        return ret;
+}
 
-        ret = lseek(fd, LBA_SIZE * gpt_hdr.first_part_lba, SEEK_SET);
-        if (ret == -1) {
-                log("lseek first part LBA failed: %s\n", strerror(errno));
-                goto exit;
+/*
+ * Write a new GPT and switch to it without a reboot: the kernel partitions
+ * are updated for the next kernel users and the partition table is rebuilt.
+ * The flash worker must be idle, no partition handle may be in use.
+ */
+int part_update_gpt(const char *data, size_t size)
+{
+        unsigned int old_count;
+        struct gpt_entry *old;
+
+        old = part_save_gpt(&old_count);
+        if (!old)
+                return -1;
+
+        if (gpt_replace(data, size)) {
+                free(old);
+                return -1;
         }
 
-        partitions_size = gpt_hdr.n_parts * gpt_hdr.part_entry_len;
-        partitions = malloc(partitions_size);
+        return part_apply_gpt(old, old_count);
+}
 
-        char *buffer = (char *)partitions;
-        ret = kread_full(fd, buffer, partitions_size, 4096);
-        if (ret == -1) {
-                log("read partitions failed\n");
-                free(partitions);
-                goto exit;
+/*
+ * Read the GPT again once the whole disk was rewritten (erase of mmc0), with
+ * the same constraints as part_update_gpt. A disk left without GPT only has
+ * the whole devices in the table, until a GPT is flashed.
+ */
+int part_reload_gpt(void)
+{
+        unsigned int old_count;
+        struct gpt_entry *old;
+
+        old = part_save_gpt(&old_count);
+        if (!old)
+                return -1;
+
+        if (gpt_load(part_disk_fd))
+                log("no GPT left on %s\n", MMC_BLK);
+
+        return part_apply_gpt(old, old_count);
+}
+
+int part_init(void)
+{
+        if (!file_exist(MMC_BLK)) {
+                if (wait_file_created(MMC_BLK)) {
+                        log("cannot get mmc node\n");
+                        return -1;
+                }
         }
 
-        part_fill_hashmap(partitions, gpt_hdr.n_parts);
-        free(partitions);
+        /* partitions only need the disk node, not the ones mdev creates for them */
+        if (part_open_device(MMC_BLK, &part_disk_fd, &part_disk_direct_fd))
+                return -1;
 
-        /* enable write access to boot partitions */
+        if (gpt_load(part_disk_fd)) {
+                close(part_disk_fd);
+                if (part_disk_direct_fd != -1)
+                        close(part_disk_direct_fd);
+                return -1;
+        }
+
+        /* enable write access to boot partitions, before their handles are opened */
         if (write_to_file(MMC_SYS_BOOT0_RO, "0", 1))
                 log("cannot enable write access on %sn", MMC_SYS_BOOT0_RO);
         if (write_to_file(MMC_SYS_BOOT1_RO, "0", 1))
                 log("cannot enable write access on %sn", MMC_SYS_BOOT1_RO);
 
-exit:
-        close(fd);
-        return ret;
+        if (part_fill_table())
+                return -1;
+
+        if (SPARSE_WRITERS > 1) {
+                part_writers = tpool_create(SPARSE_WRITERS);
+                if (!part_writers)
+                        log("sparse images are written from a single thread\n");
+        }
+
+        return 0;
 }
@@ -7,6 +7,7 @@
 #ifndef PART_H
 #define PART_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -16,16 +17,59 @@
 #define MMC_BLK_BOOT1    "/dev/mmcblk0boot1"
 #define MMC_SYS_BOOT1_RO "/sys/block/mmcblk0boot1/force_ro"
 
+#define PART_NAME_SIZE 37
+#define PART_PATH_SIZE 32
+#define PART_GUID_SIZE 16
+
+/*
+ * Partition handle opened by part_init: fd is kept open (read-write when
+ * possible), direct_fd is its O_DIRECT twin or -1. GPT partitions share the
+ * whole disk handles, their data is at offset and all accesses must stay
+ * within size. The LBA range is the GPT one or the whole device. GUIDs and
+ * attributes are only set for GPT partitions.
+ */
+struct part_info {
+        char name[PART_NAME_SIZE];
+        char path[PART_PATH_SIZE];
+        int fd;
+        int direct_fd;
+        uint64_t offset;
+        uint64_t size;
+        uint64_t lba_start;
+        uint64_t lba_end;
+        uint64_t attributes;
+        uint8_t type_guid[PART_GUID_SIZE];
+        uint8_t part_guid[PART_GUID_SIZE];
+        unsigned int block_size;
+        unsigned int io_opt;
+};
+
 int part_init(void);
 
 char *part_get_path(char *name);
+struct part_info *part_get_by_name(const char *name);
+struct part_info *part_get_info(const char *path);
+unsigned int part_count(void);
+struct part_info *part_get_index(unsigned int index);
+const char *part_get_type(struct part_info *info);
 uint64_t part_get_size(char *path);
 
 int part_read(char *path, void *buffer, size_t offset, size_t size);
 int part_flash(char *path, void *data, uint64_t *offset, size_t size);
-int part_erase(char *path, size_t len);
+
+struct part_stream;
+
+struct part_stream *part_stream_open(struct part_info *info, uint64_t offset);
+int part_stream_write(struct part_stream *stream, void *data, size_t size);
+int part_stream_close(struct part_stream *stream, uint64_t *offset);
+void part_stream_extent(struct part_stream *stream, uint64_t *start, uint64_t *end);
+bool part_stream_compressed(struct part_stream *stream);
+void part_set_discard_dont_care(bool enable);
+void part_set_delta(bool enable);
 
 int part_read_attr(char *name, uint64_t *attr);
 int part_write_attr(char *name, uint64_t attr);
+int part_update_gpt(const char *data, size_t size);
+int part_reload_gpt(void);
 
 #endif
@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "utils.h"
+
+#define POOL_MAX_SIZE   (512 * SZ_1M)
+#define POOL_MIN_SIZE   (64 * SZ_1M)
+#define POOL_MAX_BLOCKS 64
+#define POOL_ALIGN      4096
+
+/*
+ * Download arena: one prefaulted and locked mapping carved in FIFO order.
+ * Downloads are flashed (and released) in the order they were received, so a
+ * ring allocator is enough: blocks are allocated at head and space is
+ * reclaimed from the oldest block once it and all its predecessors are freed.
+ */
+struct pool_block {
+        size_t offset;
+        size_t size;
+        bool used;
+};
+
+static struct {
+        char *base;
+        size_t size;
+        size_t head;
+        struct pool_block blocks[POOL_MAX_BLOCKS];
+        unsigned int first;
+        unsigned int count;
+        bool released;
+        pthread_mutex_t mutex;
+} pool = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static char *pool_map(size_t size)
+{
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+        char *base;
+
+        /* hugetlb pages are only available if some were reserved */
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED)
+                return base;
+
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (base == MAP_FAILED)
+                return NULL;
+
+        madvise(base, size, MADV_HUGEPAGE);
+
+        return base;
+}
+
+static void pool_unmap(void)
+{
+        munmap(pool.base, pool.size);
+        pool.base = NULL;
+        pool.size = 0;
+}
+
+int pool_init(void)
+{
+        size_t size = MIN(mem_avail() / 3 * 2, POOL_MAX_SIZE);
+
+        size &= ~(size_t)(SZ_1M - 1);
+
+        while (size >= POOL_MIN_SIZE) {
+                pool.base = pool_map(size);
+                if (pool.base)
+                        break;
+                size /= 2;
+        }
+
+        if (!pool.base) {
+                log("cannot allocate download pool: %s\n", strerror(errno));
+                return -1;
+        }
+
+        if (mlock(pool.base, size))
+                log("cannot lock download pool: %s\n", strerror(errno));
+
+        pool.size = size;
+
+        log("download pool: %zu MiB\n", size / SZ_1M);
+
+        return 0;
+}
+
+size_t pool_size(void)
+{
+        return pool.released ? 0 : pool.size;
+}
+
+static struct pool_block *pool_block(unsigned int i)
+{
+        return &pool.blocks[(pool.first + i) % POOL_MAX_BLOCKS];
+}
+
+static bool pool_fit(size_t size, size_t *offset)
+{
+        size_t tail;
+
+        if (!pool.count) {
+                pool.head = 0;
+                *offset = 0;
+                return size <= pool.size;
+        }
+
+        tail = pool_block(0)->offset;
+
+        /* free space is [head, end) + [0, tail), or [head, tail) once wrapped */
+        if (pool.head > tail) {
+                if (size <= pool.size - pool.head) {
+                        *offset = pool.head;
+                        return true;
+                }
+                *offset = 0;
+                return size <= tail;
+        }
+
+        *offset = pool.head;
+        return size <= tail - pool.head;
+}
+
+void *pool_alloc(size_t size)
+{
+        struct pool_block *block;
+        size_t offset;
+        void *data = NULL;
+
+        if (!pool.base || pool.released)
+                return malloc(size);
+
+        size = size ? DIV_ROUND_UP(size, POOL_ALIGN) * POOL_ALIGN : POOL_ALIGN;
+
+        pthread_mutex_lock(&pool.mutex);
+
+        if (pool.count < POOL_MAX_BLOCKS && pool_fit(size, &offset)) {
+                block = pool_block(pool.count++);
+                block->offset = offset;
+                block->size = size;
+                block->used = true;
+
+                pool.head = offset + size;
+                data = pool.base + offset;
+        }
+
+        pthread_mutex_unlock(&pool.mutex);
+
+        return data;
+}
+
+void pool_free(void *data)
+{
+        char *ptr = data;
+
+        if (!data)
+                return;
+
+        if (!pool.base || ptr < pool.base || ptr >= pool.base + pool.size) {
+                free(data);
+                return;
+        }
+
+        pthread_mutex_lock(&pool.mutex);
+
+        for (unsigned int i = 0; i < pool.count; i++) {
+                if (pool.base + pool_block(i)->offset == ptr) {
+                        pool_block(i)->used = false;
+                        break;
+                }
+        }
+
+        /* reclaim space from the oldest blocks */
+        while (pool.count && !pool_block(0)->used) {
+                pool.first = (pool.first + 1) % POOL_MAX_BLOCKS;
+                pool.count--;
+        }
+
+        if (pool.released && !pool.count)
+                pool_unmap();
+
+        pthread_mutex_unlock(&pool.mutex);
+}
+
+/*
+ * Give the arena back to the system before booting: the next kernel and its
+ * ramdisk are staged in memory. The blocks still in use (the image of
+ * fastboot boot) stay mapped, the arena is unmapped once they are freed.
+ * Later allocations fall back to malloc.
+ */
+void pool_release(void)
+{
+        size_t tail;
+
+        if (!pool.base)
+                return;
+
+        pthread_mutex_lock(&pool.mutex);
+
+        munlock(pool.base, pool.size);
+        pool.released = true;
+
+        if (!pool.count) {
+                pool_unmap();
+                pthread_mutex_unlock(&pool.mutex);
+                return;
+        }
+
+        /* drop the pages of the free space, [head, tail) or [0, tail) + [head, end) */
+        tail = pool_block(0)->offset;
+        if (pool.head > tail) {
+                madvise(pool.base, tail, MADV_DONTNEED);
+                madvise(pool.base + pool.head, pool.size - pool.head, MADV_DONTNEED);
+        } else {
+                madvise(pool.base + pool.head, tail - pool.head, MADV_DONTNEED);
+        }
+
+        pthread_mutex_unlock(&pool.mutex);
+}
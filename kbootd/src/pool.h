@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+int pool_init(void);
+size_t pool_size(void);
+
+void *pool_alloc(size_t size);
+void pool_free(void *data);
+void pool_release(void);
+
+#endif
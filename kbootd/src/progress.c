@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <time.h>
+
+#include "progress.h"
+#include "utils.h"
+
+static uint64_t progress_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void progress_start(struct progress *progress, const char *what, uint64_t total)
+{
+        progress->what = what;
+        atomic_store(&progress->done, 0);
+        atomic_store(&progress->total, total);
+        progress->start = progress_now();
+        progress->last = progress->start;
+}
+
+void progress_add(struct progress *progress, uint64_t done, uint64_t total)
+{
+        atomic_fetch_add(&progress->done, done);
+        atomic_fetch_add(&progress->total, total);
+}
+
+void progress_set(struct progress *progress, uint64_t done, uint64_t total)
+{
+        atomic_store(&progress->done, done);
+        atomic_store(&progress->total, total);
+}
+
+/*
+ * Format "<what>: <done>/<total> MiB, <rate> MiB/s, ETA <n>s" at most once
+ * every PROGRESS_PERIOD_MS, returns false when nothing is to be reported.
+ */
+bool progress_report(struct progress *progress, char *msg, size_t size)
+{
+        uint64_t now = progress_now();
+        uint64_t done, total, elapsed, rate;
+
+        if (now - progress->last < PROGRESS_PERIOD_MS)
+                return false;
+
+        progress->last = now;
+
+        done = atomic_load(&progress->done);
+        total = atomic_load(&progress->total);
+        elapsed = now - progress->start;
+
+        /* bytes per second */
+        rate = elapsed ? done * 1000 / elapsed : 0;
+
+        if (rate && total > done)
+                snprintf(msg, size, "%s: %llu/%llu MiB, %llu.%llu MiB/s, ETA %llus",
+                         progress->what, (unsigned long long)(done / SZ_1M),
+                         (unsigned long long)(total / SZ_1M),
+                         (unsigned long long)(rate / SZ_1M),
+                         (unsigned long long)(rate % SZ_1M * 10 / SZ_1M),
+                         (unsigned long long)DIV_ROUND_UP(total - done, rate));
+        else
+                snprintf(msg, size, "%s: %llu/%llu MiB", progress->what,
+                         (unsigned long long)(done / SZ_1M),
+                         (unsigned long long)(total / SZ_1M));
+
+        return true;
+}
+
+/* log the overall throughput once an operation is over */
+void progress_log(struct progress *progress)
+{
+        uint64_t done = atomic_load(&progress->done);
+        uint64_t elapsed = progress_now() - progress->start;
+
+        log("%s: %llu MiB in %llu.%03llus, %llu MiB/s\n", progress->what,
+            (unsigned long long)(done / SZ_1M), (unsigned long long)(elapsed / 1000),
+            (unsigned long long)(elapsed % 1000),
+            (unsigned long long)(elapsed ? done * 1000 / elapsed / SZ_1M : 0));
+}
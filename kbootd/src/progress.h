@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* minimum delay between two progress reports */
+#define PROGRESS_PERIOD_MS 1000
+
+/* called by long operations with the bytes done so far */
+typedef void (*progress_cb)(void *priv, uint64_t done, uint64_t total);
+
+/*
+ * Bytes done out of total for an operation. done and total can be updated
+ * from any thread, reports are formatted by the thread talking to the host.
+ */
+struct progress {
+        const char *what;
+        atomic_uint_least64_t done;
+        atomic_uint_least64_t total;
+        uint64_t start;
+        uint64_t last;
+};
+
+void progress_start(struct progress *progress, const char *what, uint64_t total);
+void progress_add(struct progress *progress, uint64_t done, uint64_t total);
+void progress_set(struct progress *progress, uint64_t done, uint64_t total);
+bool progress_report(struct progress *progress, char *msg, size_t size);
+void progress_log(struct progress *progress);
+
+#endif
@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#endif
+
+#include "sha256.h"
+
+static const uint32_t sha256_k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+        0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+        0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+        0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+        0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+        0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+        0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+        0xc67178f2,
+};
+
+#if defined(__aarch64__)
+static bool sha256_hw;
+#endif
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+static void sha256_detect(void)
+{
+#if defined(__aarch64__) && defined(HWCAP_SHA2)
+        sha256_hw = getauxval(AT_HWCAP) & HWCAP_SHA2;
+#endif
+}
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_sw(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+        uint32_t w[64], s[8], t1, t2;
+
+        while (blocks--) {
+                for (int i = 0; i < 16; i++)
+                        w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 |
+                               (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+
+                for (int i = 16; i < 64; i++)
+                        w[i] = w[i - 16] + w[i - 7] +
+                               (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+                               (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+                memcpy(s, state, sizeof(s));
+
+                for (int i = 0; i < 64; i++) {
+                        t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) +
+                             ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+                        t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) +
+                             ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+
+                        memmove(s + 1, s, 7 * sizeof(uint32_t));
+                        s[4] += t1;
+                        s[0] = t1 + t2;
+                }
+
+                for (int i = 0; i < 8; i++)
+                        state[i] += s[i];
+
+                data += SHA256_BLOCK_SIZE;
+        }
+}
+
+#if defined(__aarch64__)
+__attribute__((target("+crypto"))) static void sha256_blocks_arm(uint32_t *state,
+                                                                  const uint8_t *data,
+                                                                  size_t blocks)
+{
+        uint32x4_t abcd = vld1q_u32(&state[0]);
+        uint32x4_t efgh = vld1q_u32(&state[4]);
+        uint32x4_t abcd_save, efgh_save, abcd_prev, wk;
+        uint32x4_t msg[4];
+
+        while (blocks--) {
+                abcd_save = abcd;
+                efgh_save = efgh;
+
+                for (int i = 0; i < 4; i++)
+                        msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+
+                /* 4 rounds per iteration, the schedule runs 3 groups ahead */
+                for (int i = 0; i < 16; i++) {
+                        wk = vaddq_u32(msg[i % 4], vld1q_u32(&sha256_k[i * 4]));
+
+                        abcd_prev = abcd;
+                        abcd = vsha256hq_u32(abcd, efgh, wk);
+                        efgh = vsha256h2q_u32(efgh, abcd_prev, wk);
+
+                        if (i < 12)
+                                msg[i % 4] = vsha256su1q_u32(
+                                        vsha256su0q_u32(msg[i % 4], msg[(i + 1) % 4]),
+                                        msg[(i + 2) % 4], msg[(i + 3) % 4]);
+                }
+
+                abcd = vaddq_u32(abcd, abcd_save);
+                efgh = vaddq_u32(efgh, efgh_save);
+
+                data += SHA256_BLOCK_SIZE;
+        }
+
+        vst1q_u32(&state[0], abcd);
+        vst1q_u32(&state[4], efgh);
+}
+#endif
+
+static void sha256_blocks(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+#if defined(__aarch64__)
+        if (sha256_hw) {
+                sha256_blocks_arm(state, data, blocks);
+                return;
+        }
+#endif
+
+        sha256_blocks_sw(state, data, blocks);
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+        static const uint32_t iv[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+        };
+
+        pthread_once(&sha256_once, sha256_detect);
+
+        memcpy(ctx->state, iv, sizeof(iv));
+        ctx->count = 0;
+        ctx->buf_len = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t size)
+{
+        const uint8_t *ptr = data;
+        size_t count;
+
+        ctx->count += size;
+
+        if (ctx->buf_len) {
+                count = SHA256_BLOCK_SIZE - ctx->buf_len;
+                if (count > size)
+                        count = size;
+
+                memcpy(ctx->buf + ctx->buf_len, ptr, count);
+                ctx->buf_len += count;
+                ptr += count;
+                size -= count;
+
+                if (ctx->buf_len < SHA256_BLOCK_SIZE)
+                        return;
+
+                sha256_blocks(ctx->state, ctx->buf, 1);
+                ctx->buf_len = 0;
+        }
+
+        count = size / SHA256_BLOCK_SIZE;
+        if (count) {
+                sha256_blocks(ctx->state, ptr, count);
+                ptr += count * SHA256_BLOCK_SIZE;
+                size -= count * SHA256_BLOCK_SIZE;
+        }
+
+        memcpy(ctx->buf, ptr, size);
+        ctx->buf_len = size;
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+        uint64_t bits = ctx->count * 8;
+
+        ctx->buf[ctx->buf_len++] = 0x80;
+
+        if (ctx->buf_len > SHA256_BLOCK_SIZE - 8) {
+                memset(ctx->buf + ctx->buf_len, 0, SHA256_BLOCK_SIZE - ctx->buf_len);
+                sha256_blocks(ctx->state, ctx->buf, 1);
+                ctx->buf_len = 0;
+        }
+
+        memset(ctx->buf + ctx->buf_len, 0, SHA256_BLOCK_SIZE - 8 - ctx->buf_len);
+        for (int i = 0; i < 8; i++)
+                ctx->buf[SHA256_BLOCK_SIZE - 1 - i] = bits >> (i * 8);
+
+        sha256_blocks(ctx->state, ctx->buf, 1);
+
+        for (int i = 0; i < 8; i++) {
+                digest[i * 4] = ctx->state[i] >> 24;
+                digest[i * 4 + 1] = ctx->state[i] >> 16;
+                digest[i * 4 + 2] = ctx->state[i] >> 8;
+                digest[i * 4 + 3] = ctx->state[i];
+        }
+}
+
+void sha256(const void *data, size_t size, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+        struct sha256_ctx ctx;
+
+        sha256_init(&ctx);
+        sha256_update(&ctx, data, size);
+        sha256_final(&ctx, digest);
+}
+
+/* hex must hold 2 * SHA256_DIGEST_SIZE + 1 bytes */
+void sha256_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char *hex)
+{
+        for (int i = 0; i < SHA256_DIGEST_SIZE; i++)
+                sprintf(hex + i * 2, "%02x", digest[i]);
+}
@@ -0,0 +1,295 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "sparse.h"
+#include "utils.h"
+
+#define SPARSE_HEADER_LEN sizeof(struct sparse_header)
+
+bool sparse_image(void *data)
+{
+        struct sparse_header *sparse_header = (struct sparse_header *)data;
+
+        if ((sparse_header->magic == SPARSE_HEADER_MAGIC) &&
+            (sparse_header->major_version) == 1)
+                return true;
+
+        return false;
+}
+
+void sparse_decoder_init(struct sparse_decoder *dec, const struct sparse_ops *ops,
+                         void *priv, uint64_t max_size)
+{
+        memset(dec, 0, sizeof(struct sparse_decoder));
+        dec->ops = ops;
+        dec->priv = priv;
+        dec->max_size = max_size;
+        dec->state = SPARSE_STATE_HEADER;
+        dec->need = SPARSE_HEADER_LEN;
+}
+
+bool sparse_decoder_done(struct sparse_decoder *dec)
+{
+        return dec->state == SPARSE_STATE_DONE;
+}
+
+/* Accumulate up to dec->need bytes in dec->buf, return true once complete */
+static bool sparse_gather(struct sparse_decoder *dec, char **data, size_t *size)
+{
+        size_t count = MIN(dec->need - dec->buf_len, *size);
+
+        memcpy(dec->buf + dec->buf_len, *data, count);
+        dec->buf_len += count;
+        *data += count;
+        *size -= count;
+
+        return dec->buf_len == dec->need;
+}
+
+static void sparse_next_chunk(struct sparse_decoder *dec)
+{
+        dec->buf_len = 0;
+
+        if (dec->chunk == dec->header.total_chunks) {
+                dec->state = SPARSE_STATE_DONE;
+                return;
+        }
+
+        dec->chunk++;
+        dec->state = SPARSE_STATE_CHUNK_HEADER;
+        dec->need = CHUNK_HEADER_LEN;
+}
+
+static int sparse_check_bounds(struct sparse_decoder *dec, uint64_t len)
+{
+        if (dec->max_size && (dec->offset + len) > dec->max_size) {
+                log("request would exceed partition size\n");
+                return -1;
+        }
+
+        return 0;
+}
+
+static int sparse_check_image(struct sparse_decoder *dec)
+{
+        uint32_t checksum = dec->header.image_checksum;
+
+        if (dec->state != SPARSE_STATE_DONE || !checksum)
+                return 0;
+
+        if (checksum != dec->crc) {
+                log("sparse image checksum mismatch: %08x != %08x\n", checksum, dec->crc);
+                return -1;
+        }
+
+        return 0;
+}
+
+static int sparse_parse_header(struct sparse_decoder *dec)
+{
+        struct sparse_header *hdr = &dec->header;
+
+        memcpy(hdr, dec->buf, SPARSE_HEADER_LEN);
+
+        if (!sparse_image(hdr)) {
+                log("invalid sparse header\n");
+                return -1;
+        }
+
+        if (hdr->file_hdr_sz < SPARSE_HEADER_LEN || hdr->chunk_hdr_sz < CHUNK_HEADER_LEN ||
+            !hdr->blk_sz || hdr->blk_sz % 4) {
+                log("bogus sparse header\n");
+                return -1;
+        }
+
+        /* Skip the remaining bytes in a header that is longer than we expected */
+        dec->skip = hdr->file_hdr_sz - SPARSE_HEADER_LEN;
+        sparse_next_chunk(dec);
+
+        return 0;
+}
+
+static int sparse_parse_chunk_header(struct sparse_decoder *dec)
+{
+        struct chunk_header *chunk = &dec->chunk_header;
+        uint64_t len;
+        int ret;
+
+        memcpy(chunk, dec->buf, CHUNK_HEADER_LEN);
+
+        if (chunk->total_sz < dec->header.chunk_hdr_sz) {
+                log("bogus chunk size: %u\n", chunk->total_sz);
+                return -1;
+        }
+
+        dec->skip = dec->header.chunk_hdr_sz - CHUNK_HEADER_LEN;
+        dec->remaining = chunk->total_sz - dec->header.chunk_hdr_sz;
+        dec->buf_len = 0;
+        len = (uint64_t)chunk->chunk_sz * dec->header.blk_sz;
+
+        switch (chunk->chunk_type) {
+        case CHUNK_TYPE_RAW:
+                if (dec->remaining != len) {
+                        log("bogus chunk size for chunk type RAW\n");
+                        return -1;
+                }
+
+                if (sparse_check_bounds(dec, len))
+                        return -1;
+
+                dec->state = SPARSE_STATE_RAW;
+                break;
+
+        case CHUNK_TYPE_FILL:
+                if (dec->remaining != sizeof(uint32_t)) {
+                        log("bogus chunk size for chunk type FILL\n");
+                        return -1;
+                }
+
+                if (sparse_check_bounds(dec, len))
+                        return -1;
+
+                dec->state = SPARSE_STATE_FILL;
+                dec->need = sizeof(uint32_t);
+                break;
+
+        case CHUNK_TYPE_DONT_CARE:
+                if (dec->remaining) {
+                        log("bogus chunk size for chunk type DONT_CARE\n");
+                        return -1;
+                }
+
+                ret = dec->ops->skip(dec->priv, dec->offset, len);
+                if (ret)
+                        return ret;
+
+                dec->crc = crc32_fill(dec->crc, 0, len);
+
+                dec->offset += len;
+                sparse_next_chunk(dec);
+                break;
+
+        case CHUNK_TYPE_CRC32:
+                if (dec->remaining != sizeof(uint32_t)) {
+                        log("bogus chunk size for chunk type CRC32\n");
+                        return -1;
+                }
+
+                dec->state = SPARSE_STATE_CRC32;
+                dec->need = sizeof(uint32_t);
+                break;
+
+        default:
+                log("unknown chunk type: %x\n", chunk->chunk_type);
+                return -1;
+        }
+
+        return 0;
+}
+
+int sparse_decoder_feed(struct sparse_decoder *dec, void *data, size_t size)
+{
+        char *ptr = data;
+        size_t count;
+        uint64_t len;
+        uint32_t value;
+        int ret;
+
+        while (size) {
+                if (dec->skip) {
+                        count = MIN(dec->skip, size);
+                        dec->skip -= count;
+                        ptr += count;
+                        size -= count;
+                        continue;
+                }
+
+                switch (dec->state) {
+                case SPARSE_STATE_HEADER:
+                        if (!sparse_gather(dec, &ptr, &size))
+                                break;
+
+                        ret = sparse_parse_header(dec);
+                        if (ret)
+                                return ret;
+                        break;
+
+                case SPARSE_STATE_CHUNK_HEADER:
+                        if (!sparse_gather(dec, &ptr, &size))
+                                break;
+
+                        ret = sparse_parse_chunk_header(dec);
+                        if (ret)
+                                return ret;
+                        break;
+
+                case SPARSE_STATE_RAW:
+                        /* RAW payloads are forwarded as they come, no copy */
+                        count = MIN(dec->remaining, size);
+                        if (count) {
+                                ret = dec->ops->write(dec->priv, dec->offset, ptr, count);
+                                if (ret)
+                                        return ret;
+
+                                /* overlaps with the writes queued above */
+                                dec->crc = crc32_update(dec->crc, ptr, count);
+                        }
+
+                        dec->offset += count;
+                        dec->remaining -= count;
+                        ptr += count;
+                        size -= count;
+
+                        if (!dec->remaining)
+                                sparse_next_chunk(dec);
+                        break;
+
+                case SPARSE_STATE_FILL:
+                        if (!sparse_gather(dec, &ptr, &size))
+                                break;
+
+                        memcpy(&value, dec->buf, sizeof(uint32_t));
+                        len = (uint64_t)dec->chunk_header.chunk_sz * dec->header.blk_sz;
+
+                        ret = dec->ops->fill(dec->priv, dec->offset, value, len);
+                        if (ret)
+                                return ret;
+
+                        dec->crc = crc32_fill(dec->crc, value, len);
+
+                        dec->offset += len;
+                        sparse_next_chunk(dec);
+                        break;
+
+                case SPARSE_STATE_CRC32:
+                        if (!sparse_gather(dec, &ptr, &size))
+                                break;
+
+                        memcpy(&value, dec->buf, sizeof(uint32_t));
+                        if (value != dec->crc) {
+                                log("CRC32 chunk mismatch: %08x != %08x\n", value, dec->crc);
+                                return -1;
+                        }
+
+                        sparse_next_chunk(dec);
+                        break;
+
+                case SPARSE_STATE_DONE:
+                        log("unexpected data after sparse image: %zu bytes\n", size);
+                        return -1;
+                }
+        }
+
+        /* Zero-length RAW chunks and trailing DONT_CARE need no more input */
+        while (dec->state == SPARSE_STATE_RAW && !dec->remaining && !dec->skip)
+                sparse_next_chunk(dec);
+
+        return sparse_check_image(dec);
+}
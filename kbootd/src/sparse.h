@@ -7,6 +7,10 @@
 #ifndef SPARSE_H
 #define SPARSE_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #define SPARSE_HEADER_MAGIC 0xed26ff3a
 
 struct sparse_header {
@@ -35,4 +39,53 @@ struct chunk_header {
 
 #define CHUNK_HEADER_LEN sizeof(struct chunk_header)
 
+/* Output operations emitted by the decoder, offsets are in the output image */
+struct sparse_ops {
+        int (*write)(void *priv, uint64_t offset, void *data, size_t size);
+        int (*fill)(void *priv, uint64_t offset, uint32_t value, uint64_t size);
+        int (*skip)(void *priv, uint64_t offset, uint64_t size);
+};
+
+enum sparse_state {
+        SPARSE_STATE_HEADER,
+        SPARSE_STATE_CHUNK_HEADER,
+        SPARSE_STATE_RAW,
+        SPARSE_STATE_FILL,
+        SPARSE_STATE_CRC32,
+        SPARSE_STATE_DONE,
+};
+
+/*
+ * Resumable sparse image decoder: data can be fed in fragments of any size,
+ * partial headers are kept in buf until complete and RAW payloads are
+ * forwarded to the write operation as they arrive.
+ *
+ * The CRC32 of the output image is computed along the way, DONT_CARE
+ * regions count as zeros like in libsparse, and checked against CRC32 chunks
+ * and the header image_checksum when set.
+ */
+struct sparse_decoder {
+        const struct sparse_ops *ops;
+        void *priv;
+        enum sparse_state state;
+        struct sparse_header header;
+        struct chunk_header chunk_header;
+        char buf[sizeof(struct sparse_header)];
+        size_t buf_len;
+        size_t need;
+        size_t skip;
+        uint32_t chunk;
+        uint64_t remaining;
+        uint64_t offset;
+        uint64_t max_size;
+        uint32_t crc;
+};
+
+bool sparse_image(void *data);
+
+void sparse_decoder_init(struct sparse_decoder *dec, const struct sparse_ops *ops,
+                         void *priv, uint64_t max_size);
+int sparse_decoder_feed(struct sparse_decoder *dec, void *data, size_t size);
+bool sparse_decoder_done(struct sparse_decoder *dec);
+
 #endif
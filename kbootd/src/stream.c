@@ -0,0 +1,168 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fastboot.h"
+#include "flash.h"
+#include "part.h"
+#include "pool.h"
+#include "stream.h"
+#include "utils.h"
+
+#define STREAM_BUF_COUNT 4
+#define STREAM_BUF_SIZE  (16 * SZ_1M)
+
+/*
+ * Ring of fixed-size buffers shared between the fastboot reader (producer)
+ * and the flash worker (consumer). Buffers are filled in order, queued as
+ * flash jobs and given back by the job completion callback. busy is the
+ * number of buffers owned by the flash worker.
+ */
+struct stream {
+        struct part_stream *part;
+        char *bufs[STREAM_BUF_COUNT];
+        unsigned int head;
+        unsigned int busy;
+        bool error;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+};
+
+static void stream_done(struct flash_job *job, int status)
+{
+        struct stream *stream = job->priv;
+
+        pthread_mutex_lock(&stream->mutex);
+        if (status)
+                stream->error = true;
+        stream->busy--;
+        pthread_cond_signal(&stream->cond);
+        pthread_mutex_unlock(&stream->mutex);
+}
+
+static int stream_alloc(struct stream *stream)
+{
+        for (int i = 0; i < STREAM_BUF_COUNT; i++) {
+                stream->bufs[i] = pool_alloc(STREAM_BUF_SIZE);
+                if (!stream->bufs[i]) {
+                        log("cannot allocate stream buffer\n");
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+static void stream_free(struct stream *stream)
+{
+        for (int i = 0; i < STREAM_BUF_COUNT; i++)
+                pool_free(stream->bufs[i]);
+}
+
+static bool stream_wait(struct stream *stream, unsigned int max_busy)
+{
+        bool error;
+
+        pthread_mutex_lock(&stream->mutex);
+        while (stream->busy > max_busy)
+                pthread_cond_wait(&stream->cond, &stream->mutex);
+        error = stream->error;
+        pthread_mutex_unlock(&stream->mutex);
+
+        return error;
+}
+
+/* everything that can fail is set up before the host is asked for the data */
+struct stream *stream_open(struct part_info *info)
+{
+        struct stream *stream;
+
+        stream = calloc(1, sizeof(struct stream));
+        if (!stream) {
+                log("malloc failed: %s\n", strerror(errno));
+                return NULL;
+        }
+
+        if (stream_alloc(stream))
+                goto error;
+
+        stream->part = part_stream_open(info, 0);
+        if (!stream->part)
+                goto error;
+
+        pthread_mutex_init(&stream->mutex, NULL);
+        pthread_cond_init(&stream->cond, NULL);
+
+        return stream;
+
+error:
+        stream_free(stream);
+        free(stream);
+        return NULL;
+}
+
+/* receive size bytes from the host and flash them, the stream is released */
+int stream_flash(struct stream *stream, size_t size)
+{
+        struct flash_job job;
+        size_t count;
+        bool error = false;
+        int ret;
+
+        while (size) {
+                count = MIN(size, STREAM_BUF_SIZE);
+
+                /* wait for the flash worker to give a buffer back */
+                if (stream_wait(stream, STREAM_BUF_COUNT - 1))
+                        error = true;
+
+                ret = fastboot_read_full(stream->bufs[stream->head], count);
+                if (ret) {
+                        log("stream read failed\n");
+                        error = true;
+                        break;
+                }
+
+                size -= count;
+
+                /* keep draining the host data, but stop flashing after an error */
+                if (error)
+                        continue;
+
+                job = (struct flash_job){
+                        .stream = stream->part,
+                        .data = stream->bufs[stream->head],
+                        .size = count,
+                        .done = stream_done,
+                        .priv = stream,
+                };
+
+                pthread_mutex_lock(&stream->mutex);
+                stream->busy++;
+                pthread_mutex_unlock(&stream->mutex);
+
+                flash_queue(&job);
+                stream->head = (stream->head + 1) % STREAM_BUF_COUNT;
+        }
+
+        if (stream_wait(stream, 0))
+                error = true;
+
+        if (part_stream_close(stream->part, NULL))
+                error = true;
+
+        pthread_cond_destroy(&stream->cond);
+        pthread_mutex_destroy(&stream->mutex);
+        stream_free(stream);
+        free(stream);
+
+        return error ? -1 : 0;
+}
@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+
+struct part_info;
+struct stream;
+
+struct stream *stream_open(struct part_info *info);
+int stream_flash(struct stream *stream, size_t size);
+
+#endif
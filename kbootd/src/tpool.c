@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tpool.h"
+#include "utils.h"
+
+/*
+ * Fixed set of persistent threads consuming a FIFO of tasks. pending counts
+ * the queued and running tasks so that tpool_wait can tell when the pool is
+ * idle again.
+ */
+struct tpool_task {
+        tpool_fn fn;
+        void *arg;
+        struct tpool_task *next;
+};
+
+struct tpool_worker {
+        struct tpool *pool;
+        unsigned int index;
+        pthread_t thread;
+};
+
+struct tpool {
+        struct tpool_task *first;
+        struct tpool_task *last;
+        unsigned int pending;
+        pthread_mutex_t mutex;
+        pthread_cond_t work;
+        pthread_cond_t idle;
+        unsigned int threads;
+        struct tpool_worker workers[];
+};
+
+static void *tpool_thread(void *arg)
+{
+        struct tpool_worker *worker = arg;
+        struct tpool *pool = worker->pool;
+        struct tpool_task *task;
+
+        while (1) {
+                pthread_mutex_lock(&pool->mutex);
+                while (!pool->first)
+                        pthread_cond_wait(&pool->work, &pool->mutex);
+
+                task = pool->first;
+                pool->first = task->next;
+                if (!pool->first)
+                        pool->last = NULL;
+                pthread_mutex_unlock(&pool->mutex);
+
+                task->fn(task->arg, worker->index);
+                free(task);
+
+                pthread_mutex_lock(&pool->mutex);
+                if (!--pool->pending)
+                        pthread_cond_broadcast(&pool->idle);
+                pthread_mutex_unlock(&pool->mutex);
+        }
+
+        return NULL;
+}
+
+struct tpool *tpool_create(unsigned int threads)
+{
+        struct tpool *pool;
+
+        pool = calloc(1, sizeof(struct tpool) + threads * sizeof(struct tpool_worker));
+        if (!pool) {
+                log("malloc failed: %s\n", strerror(errno));
+                return NULL;
+        }
+
+        pthread_mutex_init(&pool->mutex, NULL);
+        pthread_cond_init(&pool->work, NULL);
+        pthread_cond_init(&pool->idle, NULL);
+
+        for (unsigned int i = 0; i < threads; i++) {
+                pool->workers[i].pool = pool;
+                pool->workers[i].index = i;
+
+                if (pthread_create(&pool->workers[i].thread, NULL, tpool_thread,
+                                   &pool->workers[i])) {
+                        log("cannot create pool thread\n");
+                        /* threads already started keep waiting for work */
+                        if (!i) {
+                                free(pool);
+                                return NULL;
+                        }
+                        break;
+                }
+
+                pool->threads++;
+        }
+
+        return pool;
+}
+
+unsigned int tpool_threads(struct tpool *pool)
+{
+        return pool->threads;
+}
+
+int tpool_queue(struct tpool *pool, tpool_fn fn, void *arg)
+{
+        struct tpool_task *task;
+
+        task = malloc(sizeof(struct tpool_task));
+        if (!task) {
+                log("malloc failed: %s\n", strerror(errno));
+                return -1;
+        }
+
+        task->fn = fn;
+        task->arg = arg;
+        task->next = NULL;
+
+        pthread_mutex_lock(&pool->mutex);
+        if (pool->last)
+                pool->last->next = task;
+        else
+                pool->first = task;
+        pool->last = task;
+        pool->pending++;
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->mutex);
+
+        return 0;
+}
+
+void tpool_wait(struct tpool *pool)
+{
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->pending)
+                pthread_cond_wait(&pool->idle, &pool->mutex);
+        pthread_mutex_unlock(&pool->mutex);
+}
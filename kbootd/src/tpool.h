@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#ifndef TPOOL_H
+#define TPOOL_H
+
+struct tpool;
+
+/* worker is the index of the thread running the task, in [0, threads) */
+typedef void (*tpool_fn)(void *arg, unsigned int worker);
+
+struct tpool *tpool_create(unsigned int threads);
+unsigned int tpool_threads(struct tpool *pool);
+int tpool_queue(struct tpool *pool, tpool_fn fn, void *arg);
+void tpool_wait(struct tpool *pool);
+
+#endif
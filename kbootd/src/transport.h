@@ -0,0 +1,26 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Baylibre, SAS.
+ * Author: Julien Masson <jmasson@baylibre.com>
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+
+struct fb_transport {
+        const char *name;
+        int (*init)(void);
+        /* read at most buffer_count bytes of a single packet */
+        int (*read)(char *buffer, size_t buffer_count);
+        /* write buffer as a single packet, return 0 on success */
+        int (*write)(char *buffer, size_t buffer_count);
+        /* read exactly buffer_count bytes, return 0 on success */
+        int (*read_full)(char *buffer, size_t buffer_count);
+};
+
+extern const struct fb_transport tcp_transport;
+extern const struct fb_transport usb_transport;
+
+#endif
@@ -8,17 +8,24 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/inotify.h>
 #include <sys/sysinfo.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "utils.h"
 
 #define INOTIFY_EVENT_SIZE    (sizeof(struct inotify_event))
 #define INOTIFY_EVENT_BUF_LEN (1024 * (INOTIFY_EVENT_SIZE + 16))
 
+#define PROC_CMDLINE          "/proc/cmdline"
+
 int kread(int fd, char *buffer, size_t buffer_count)
 {
         size_t count_read;
@@ -190,6 +197,37 @@ exit:
         return ret;
 }
 
+int cmdline_get(const char *key, char *value, size_t value_size)
+{
+        char buffer[4096] = { '\0' };
+        size_t key_len = strlen(key);
+        char *token, *saveptr;
+        ssize_t count_read;
+        int fd;
+
+        fd = open(PROC_CMDLINE, O_RDONLY);
+        if (fd == -1) {
+                log("open %s failed: %s\n", PROC_CMDLINE, strerror(errno));
+                return -1;
+        }
+
+        count_read = read(fd, buffer, sizeof(buffer) - 1);
+        close(fd);
+        if (count_read <= 0)
+                return -1;
+
+        token = strtok_r(buffer, " \n", &saveptr);
+        while (token) {
+                if (!strncmp(token, key, key_len) && token[key_len] == '=') {
+                        snprintf(value, value_size, "%s", token + key_len + 1);
+                        return 0;
+                }
+                token = strtok_r(NULL, " \n", &saveptr);
+        }
+
+        return -1;
+}
+
 unsigned long mem_avail(void)
 {
         struct sysinfo info;
@@ -200,22 +238,50 @@ unsigned long mem_avail(void)
         return info.freeram;
 }
 
-void hashmap_add(struct hsearch_data *hashmap, char *key, void *data)
+/* memcmp() only telling equality, without the byte loop of musl */
+bool mem_equal(const void *a, const void *b, size_t size)
 {
-        ENTRY e = { .key = key, .data = data };
-        ENTRY *ep;
+        const uint8_t *pa = a, *pb = b;
+        uint64_t va, vb;
+
+#if defined(__aarch64__)
+        uint32x4_t diff;
+
+        while (size >= 64) {
+                diff = vorrq_u32(
+                        vorrq_u32(veorq_u32(vld1q_u32((const uint32_t *)pa),
+                                            vld1q_u32((const uint32_t *)pb)),
+                                  veorq_u32(vld1q_u32((const uint32_t *)(pa + 16)),
+                                            vld1q_u32((const uint32_t *)(pb + 16)))),
+                        vorrq_u32(veorq_u32(vld1q_u32((const uint32_t *)(pa + 32)),
+                                            vld1q_u32((const uint32_t *)(pb + 32))),
+                                  veorq_u32(vld1q_u32((const uint32_t *)(pa + 48)),
+                                            vld1q_u32((const uint32_t *)(pb + 48)))));
+
+                if (vmaxvq_u32(diff))
+                        return false;
+
+                pa += 64;
+                pb += 64;
+                size -= 64;
+        }
+#endif
 
-        if (!hsearch_r(e, ENTER, &ep, hashmap))
-                log("cannot add hashmap entry: %s\n", key);
-}
+        while (size >= sizeof(uint64_t)) {
+                memcpy(&va, pa, sizeof(uint64_t));
+                memcpy(&vb, pb, sizeof(uint64_t));
+                if (va != vb)
+                        return false;
 
-void *hashmap_get(struct hsearch_data *hashmap, char *key)
-{
-        ENTRY e = { .key = key };
-        ENTRY *ep;
+                pa += sizeof(uint64_t);
+                pb += sizeof(uint64_t);
+                size -= sizeof(uint64_t);
+        }
 
-        if (!hsearch_r(e, FIND, &ep, hashmap))
-                ep = NULL;
+        while (size--) {
+                if (*pa++ != *pb++)
+                        return false;
+        }
 
-        return ep ? ep->data : NULL;
+        return true;
 }
@@ -9,7 +9,6 @@
 
 #define _GNU_SOURCE
 
-#include <search.h>
 #include <stdbool.h>
 #include <stdio.h>
 
@@ -20,6 +19,7 @@
 #define log(...)           printf("[kbootd] " __VA_ARGS__)
 #define ARRAY_SIZE(x)      ((sizeof(x)) / (sizeof(x[0])))
 #define MIN(a, b)          ((a) < (b) ? (a) : (b))
+#define MAX(a, b)          ((a) > (b) ? (a) : (b))
 #define DIV_ROUND_UP(n, d) (((n) + (d)-1) / (d))
 #define BIT(nr)            (1 << (nr))
 
@@ -34,9 +34,10 @@ int write_to_file(const char *path, char *buffer, size_t buffer_count);
 bool file_exist(const char *path);
 int wait_file_created(const char *path);
 
+int cmdline_get(const char *key, char *value, size_t value_size);
+
 unsigned long mem_avail(void);
 
-void hashmap_add(struct hsearch_data *hashmap, char *key, void *data);
-void *hashmap_get(struct hsearch_data *hashmap, char *key);
+bool mem_equal(const void *a, const void *b, size_t size);
 
 #endif